@@ -1,5 +1,36 @@
 #include "library.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
@@ -7,9 +38,199 @@ extern "C" {
 #include <libavutil/imgutils.h>
 #include <libavutil/avutil.h>
 #include <libavcodec/bsf.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/tx.h>
+#include <libswresample/swresample.h>
 #include <jpeglib.h>
 }
 
+// Per-call statistics. The outermost library call on a thread starts a fresh record; code marks
+// phase changes as it goes, and the time between marks (wall clock and this thread's CPU clock) is
+// charged to the phase being left. Calls nested inside another (a fallback, a duration lookup)
+// add to the outer call's record. The finished record is what getLastCallStats returns.
+// Recording reads the thread CPU clock (a system call) at every mark, so it is off until
+// setCallStatsEnabled turns it on; whether a call records is fixed when its outermost scope starts.
+struct CallStats {
+    MediaCallStats stats{};
+    int depth = 0;
+    bool enabled = false;
+    int phase = MEDIA_PHASE_NONE;
+    double phaseWall = 0; // When the current phase began
+    double phaseCpu = 0;
+    double startWall = 0;
+    double startCpu = 0;
+    double stageCpu = 0;  // CPU time of pipeline threads working for this call
+};
+
+static thread_local CallStats callStats;
+static thread_local MediaCallStats lastCallStats{};
+static thread_local bool haveLastCallStats = false;
+static std::atomic<bool> callStatsEnabled{false};
+
+static double wallSeconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double threadCpuSeconds() {
+    struct timespec now{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return double(now.tv_sec) + double(now.tv_nsec) * 1e-9;
+}
+
+// Charge the time since the last mark to the current phase and switch to phase
+static void enterPhase(CallStats* stats, int phase) {
+    if (stats->depth == 0 || !stats->enabled) {
+        return; // Not inside a library call, or not recording
+    }
+    double wall = wallSeconds();
+    double cpu = threadCpuSeconds();
+    if (stats->phase != MEDIA_PHASE_NONE) {
+        stats->stats.phases[stats->phase].wallSeconds += wall - stats->phaseWall;
+        stats->stats.phases[stats->phase].cpuSeconds += cpu - stats->phaseCpu;
+    }
+    stats->phase = phase;
+    stats->phaseWall = wall;
+    stats->phaseCpu = cpu;
+}
+
+static void enterPhase(int phase) {
+    enterPhase(&callStats, phase);
+}
+
+static void countDecodedFrame() {
+    if (callStats.depth > 0 && callStats.enabled) {
+        ++callStats.stats.framesDecoded;
+    }
+}
+
+// Count what an input read before it's closed
+static void countBytesRead(const AVFormatContext* formatContext) {
+    if (callStats.depth > 0 && callStats.enabled && formatContext && formatContext->pb) {
+        callStats.stats.bytesRead += formatContext->pb->bytes_read;
+    }
+}
+
+// Enters a phase for the length of a block and goes back to the enclosing one after
+class PhaseScope {
+public:
+    explicit PhaseScope(int phase) : savedPhase(callStats.phase) {
+        enterPhase(phase);
+    }
+
+    ~PhaseScope() {
+        enterPhase(savedPhase);
+    }
+
+    PhaseScope(const PhaseScope&) = delete;
+    PhaseScope& operator=(const PhaseScope&) = delete;
+
+private:
+    int savedPhase;
+};
+
+// Records a pipeline stage thread's phases into *stats while it runs. Time the stage spends
+// blocked on its queues should be left outside any phase.
+class StageScope {
+public:
+    explicit StageScope(MediaCallStats* stageStats) : stats(stageStats) {
+        callStats = CallStats{};
+        callStats.depth = 1;
+        callStats.enabled = callStatsEnabled.load(std::memory_order_relaxed);
+        if (callStats.enabled) {
+            callStats.startCpu = threadCpuSeconds();
+        }
+    }
+
+    ~StageScope() {
+        if (callStats.enabled) {
+            enterPhase(MEDIA_PHASE_NONE);
+            callStats.stats.cpuSeconds = threadCpuSeconds() - callStats.startCpu;
+        }
+        *stats = callStats.stats;
+        callStats.depth = 0;
+    }
+
+    StageScope(const StageScope&) = delete;
+    StageScope& operator=(const StageScope&) = delete;
+
+private:
+    MediaCallStats* stats;
+};
+
+// Add a finished stage thread's record to the calling thread's
+static void mergeCallStats(const MediaCallStats& stage) {
+    if (callStats.depth == 0 || !callStats.enabled) {
+        return;
+    }
+    for (int i = 0; i < MEDIA_PHASE_COUNT; ++i) {
+        callStats.stats.phases[i].wallSeconds += stage.phases[i].wallSeconds;
+        callStats.stats.phases[i].cpuSeconds += stage.phases[i].cpuSeconds;
+    }
+    callStats.stats.framesDecoded += stage.framesDecoded;
+    callStats.stageCpu += stage.cpuSeconds;
+}
+
+// Brackets a public entry point; only the outermost one on the thread starts and publishes a record
+class CallScope {
+public:
+    CallScope() : savedPhase(callStats.phase) {
+        if (callStats.depth++ == 0) {
+            callStats.enabled = callStatsEnabled.load(std::memory_order_relaxed);
+            callStats.phase = MEDIA_PHASE_NONE;
+            if (callStats.enabled) {
+                callStats.stats = MediaCallStats{};
+                callStats.stageCpu = 0;
+                callStats.startWall = wallSeconds();
+                callStats.startCpu = threadCpuSeconds();
+            }
+        }
+    }
+
+    ~CallScope() {
+        if (callStats.depth > 1) {
+            enterPhase(savedPhase); // Back to what the outer call was doing
+            --callStats.depth;
+            return;
+        }
+        if (!callStats.enabled) {
+            callStats.depth = 0;
+            haveLastCallStats = false; // Nothing recorded, so don't report an older call's record
+            return;
+        }
+        enterPhase(MEDIA_PHASE_NONE);
+        callStats.stats.wallSeconds = wallSeconds() - callStats.startWall;
+        callStats.stats.cpuSeconds = threadCpuSeconds() - callStats.startCpu + callStats.stageCpu;
+        callStats.depth = 0;
+        lastCallStats = callStats.stats;
+        haveLastCallStats = true;
+    }
+
+    CallScope(const CallScope&) = delete;
+    CallScope& operator=(const CallScope&) = delete;
+
+private:
+    int savedPhase;
+};
+
+// avformat_close_input, counting what the input read first
+static void closeInput(AVFormatContext** formatContext) {
+    countBytesRead(*formatContext);
+    avformat_close_input(formatContext);
+}
+
+void setCallStatsEnabled(int enabled) {
+    callStatsEnabled.store(enabled != 0, std::memory_order_relaxed);
+}
+
+int getLastCallStats(MediaCallStats* stats) {
+    if (!stats || !haveLastCallStats) {
+        return 0; // No call finished on this thread yet, or it wasn't recorded
+    }
+    *stats = lastCallStats;
+    return 1;
+}
+
 enum class MediaType {
     Video,
     Audio,
@@ -29,13 +250,16 @@ MediaType getMediaType(AVFormatContext* formatContext) {
 }
 
 double getMediaDuration(const char* filePath) {
+    CallScope scope;
     AVFormatContext* formatContext = nullptr;
+    enterPhase(MEDIA_PHASE_OPEN);
     if (avformat_open_input(&formatContext, filePath, nullptr, nullptr) != 0) {
-        avformat_close_input(&formatContext);
+        closeInput(&formatContext);
         return 0;
     }
+    enterPhase(MEDIA_PHASE_PROBE);
     if (avformat_find_stream_info(formatContext, nullptr) < 0) {
-        avformat_close_input(&formatContext);
+        closeInput(&formatContext);
         return 0;
     }
     double duration = 0;
@@ -51,410 +275,4847 @@ double getMediaDuration(const char* filePath) {
             }
         }
     }
-    avformat_close_input(&formatContext);
+    closeInput(&formatContext);
     return duration;
 }
 
 int isValidMediaFile(const char* filePath) {
+    CallScope scope;
     avformat_network_init();
     AVFormatContext* formatContext = avformat_alloc_context();
     if (!formatContext)
         return 0;
+    enterPhase(MEDIA_PHASE_OPEN);
     if (avformat_open_input(&formatContext, filePath, nullptr, nullptr) != 0) {
-        avformat_close_input(&formatContext);
+        closeInput(&formatContext);
         return 0;
     }
-    avformat_close_input(&formatContext);
+    closeInput(&formatContext);
     return 1;
 }
 
-int convertMediaFormat(const char* srcFilePath, const char* destDirPath, const char* outputFileName, const char* outputFormat) {
-    AVFormatContext* inputFormatContext = nullptr;
-    AVFormatContext* outputFormatContext = nullptr;
-    AVPacket packet;
+// Keyframe index sidecar: a fixed header followed by keyframe entries sorted by PTS, written next to
+// the source as <file>.mlki and memory-mapped on use. It is only trusted while the source's size,
+// modification time (in nanoseconds) and inode match what was recorded.
+struct KeyframeIndexHeader {
+    char magic[4];
+    uint32_t version;
+    int64_t fileSize;
+    int64_t fileModified; // Nanoseconds since the epoch
+    int64_t fileInode;
+    int32_t streamIndex;
+    int32_t timeBaseNum;
+    int32_t timeBaseDen;
+    uint32_t count;
+};
 
-    // Open the input file for reading
-    AVDictionary* options = nullptr;
-    av_dict_set(&options, "bsf:v", "h264_mp4toannexb", 0);
-    if (avformat_open_input(&inputFormatContext, srcFilePath, nullptr, &options) != 0) {
-        return 0; // Couldn't open file
-    }
+struct KeyframeIndexEntry {
+    int64_t pts;
+    int64_t pos;
+    int64_t frameNumber; // Frames presented before this keyframe
+    int32_t size;
+    int32_t flags;
+};
 
-    // Retrieve stream information
-    if (avformat_find_stream_info(inputFormatContext, nullptr) < 0) {
-        return 0; // Couldn't find stream information
-    }
+static_assert(sizeof(KeyframeIndexHeader) == 48, "keyframe index header layout");
+static_assert(sizeof(KeyframeIndexEntry) == 32, "keyframe index entry layout");
 
-    // Construct output file path
-    char destFilePath[1024];
-    snprintf(destFilePath, sizeof(destFilePath), "%s/%s.%s", destDirPath, outputFileName, outputFormat);
+static const char keyframeIndexMagic[4] = {'M', 'L', 'K', 'I'};
+static const uint32_t keyframeIndexVersion = 3;
 
-    // Open output file
-    avformat_alloc_output_context2(&outputFormatContext, nullptr, outputFormat, destFilePath);
-    if (!outputFormatContext) {
-        return 0; // Couldn't create output context
-    }
+struct KeyframeIndex {
+    void* mapping = nullptr;
+    size_t mappingSize = 0;
+    const KeyframeIndexHeader* header = nullptr;
+    const KeyframeIndexEntry* entries = nullptr;
+    // Backing for an index scanned in memory rather than mapped from the sidecar
+    KeyframeIndexHeader ownedHeader{};
+    std::vector<KeyframeIndexEntry> ownedEntries;
+};
 
-    // Create new streams for output file and copy the parameters from the input streams
-    for (unsigned int i = 0; i < inputFormatContext->nb_streams; ++i) {
-        AVStream* inputStream = inputFormatContext->streams[i];
-        AVStream* outputStream = avformat_new_stream(outputFormatContext, nullptr);
-        if (!outputStream) {
-            return 0; // Failed to create new stream
-        }
+static void keyframeIndexPath(const char* srcFilePath, char* indexFilePath, size_t size) {
+    snprintf(indexFilePath, size, "%s.mlki", srcFilePath);
+}
 
-        if (avcodec_parameters_copy(outputStream->codecpar, inputStream->codecpar) < 0) {
-            return 0; // Failed to copy parameters
-        }
-        outputStream->codecpar->codec_tag = 0;
+// st_mtime alone has one-second resolution: a same-size rewrite within that second would go unnoticed
+static int64_t fileModifiedNanos(const struct stat& fileStat) {
+#if defined(__APPLE__)
+    return int64_t(fileStat.st_mtimespec.tv_sec) * 1000000000 + fileStat.st_mtimespec.tv_nsec;
+#else
+    return int64_t(fileStat.st_mtim.tv_sec) * 1000000000 + fileStat.st_mtim.tv_nsec;
+#endif
+}
 
-        // Copy the frame rate from the input stream to the output stream
-        outputStream->avg_frame_rate = inputStream->avg_frame_rate;
+// Map the sidecar for srcFilePath if there is one and it still describes the file
+static bool loadKeyframeIndex(const char* srcFilePath, KeyframeIndex* index) {
+    struct stat srcStat{};
+    if (stat(srcFilePath, &srcStat) != 0) {
+        return false;
     }
 
-    // Open output file for writing
-    if (!(outputFormatContext->oformat->flags & AVFMT_NOFILE)) {
-        if (avio_open(&outputFormatContext->pb, destFilePath, AVIO_FLAG_WRITE) < 0) {
-            return 0; // Failed to open output file
-        }
+    char indexFilePath[1024];
+    keyframeIndexPath(srcFilePath, indexFilePath, sizeof(indexFilePath));
+    int fd = open(indexFilePath, O_RDONLY);
+    if (fd < 0) {
+        return false;
     }
-
-    // Write header of output file
-    if (avformat_write_header(outputFormatContext, nullptr) < 0) {
-        return 0; // Failed to write header
+    struct stat indexStat{};
+    if (fstat(fd, &indexStat) != 0 || indexStat.st_size < (off_t)sizeof(KeyframeIndexHeader)) {
+        close(fd);
+        return false;
     }
-
-    // Read each packet and write to the output file
-    while (av_read_frame(inputFormatContext, &packet) >= 0) {
-        // Rescale packet timestamp to match output stream time base
-        av_packet_rescale_ts(&packet, inputFormatContext->streams[packet.stream_index]->time_base, outputFormatContext->streams[packet.stream_index]->time_base);
-
-        // Write packet to output file
-        av_interleaved_write_frame(outputFormatContext, &packet);
-        av_packet_unref(&packet);
+    void* mapping = mmap(nullptr, size_t(indexStat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
     }
 
-    // Write the trailer of the output file
-    av_write_trailer(outputFormatContext);
-
-    // Close input and output files
-    avformat_close_input(&inputFormatContext);
-    if (outputFormatContext && !(outputFormatContext->oformat->flags & AVFMT_NOFILE)) {
-        avio_closep(&outputFormatContext->pb);
+    auto* header = static_cast<const KeyframeIndexHeader*>(mapping);
+    bool valid = memcmp(header->magic, keyframeIndexMagic, sizeof(keyframeIndexMagic)) == 0 &&
+                 header->version == keyframeIndexVersion &&
+                 header->fileSize == int64_t(srcStat.st_size) &&
+                 header->fileModified == fileModifiedNanos(srcStat) &&
+                 header->fileInode == int64_t(srcStat.st_ino) &&
+                 size_t(indexStat.st_size) == sizeof(KeyframeIndexHeader) + size_t(header->count) * sizeof(KeyframeIndexEntry);
+    if (!valid) {
+        munmap(mapping, size_t(indexStat.st_size));
+        return false; // Stale or foreign sidecar
     }
-    avformat_free_context(outputFormatContext);
 
-    return 1; // Successful conversion
+    index->mapping = mapping;
+    index->mappingSize = size_t(indexStat.st_size);
+    index->header = header;
+    index->entries = reinterpret_cast<const KeyframeIndexEntry*>(header + 1);
+    return true;
 }
 
-int saveAsJPEG(const char* filename, uint8_t* buffer, int width, int height, int stride) {
-    struct jpeg_compress_struct cinfo{};
-    struct jpeg_error_mgr jerr{};
-
-    // Open the output file
-    FILE* outfile = fopen(filename, "wb");
-    if (!outfile) {
-        fprintf(stderr, "Error: Could not open output file %s\n", filename);
-        return -1;
+static void unloadKeyframeIndex(KeyframeIndex* index) {
+    if (index->mapping) {
+        munmap(index->mapping, index->mappingSize);
     }
+    *index = KeyframeIndex{};
+}
 
-    // Initialize the JPEG compression object
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
-    jpeg_stdio_dest(&cinfo, outfile);
-
-    // Set the image parameters
-    cinfo.image_width = width;
-    cinfo.image_height = height;
-    cinfo.input_components = 3; // RGB
-    cinfo.in_color_space = JCS_RGB;
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, 85, TRUE); // Quality (0-100)
-
-    // Start compression
-    jpeg_start_compress(&cinfo, TRUE);
-
-    // Write each row of the image
-    while (cinfo.next_scanline < cinfo.image_height) {
-        JSAMPROW row_pointer[1] = {buffer + cinfo.next_scanline * stride};
-        jpeg_write_scanlines(&cinfo, row_pointer, 1);
+// Seek so that the next packet read is the keyframe at or before timestamp (in stream time base).
+// With an index this is a direct byte seek, which avoids the timestamp search that formats without a
+// usable seek table (MPEG-TS, elementary streams) fall back to.
+static int seekVideoStream(AVFormatContext* formatContext, int videoStreamIndex, int64_t timestamp, const KeyframeIndex* index) {
+    if (index && index->header && index->header->streamIndex == videoStreamIndex && index->header->count > 0 &&
+        !(formatContext->iformat->flags & AVFMT_NO_BYTE_SEEK)) {
+        const KeyframeIndexEntry* end = index->entries + index->header->count;
+        const KeyframeIndexEntry* next = std::upper_bound(index->entries, end, timestamp, [](int64_t ts, const KeyframeIndexEntry& entry) {
+            return ts < entry.pts;
+        });
+        const KeyframeIndexEntry* entry = next == index->entries ? index->entries : next - 1;
+        if (av_seek_frame(formatContext, videoStreamIndex, entry->pos, AVSEEK_FLAG_BYTE) >= 0) {
+            return 0;
+        }
     }
+    return av_seek_frame(formatContext, videoStreamIndex, timestamp, AVSEEK_FLAG_BACKWARD);
+}
 
-    // Finish compression
-    jpeg_finish_compress(&cinfo);
-    fclose(outfile);
-    jpeg_destroy_compress(&cinfo);
+// Scan packets (no decoding) and record every keyframe with a known position. All PTS values
+// are kept so keyframes can be numbered in presentation order, which stays exact for VFR streams.
+static void scanKeyframes(AVFormatContext* formatContext, int videoStreamIndex, std::vector<KeyframeIndexEntry>* entries) {
+    AVPacket packet;
+    std::vector<int64_t> presentationTimes;
+    enterPhase(MEDIA_PHASE_COPY);
+    while (av_read_frame(formatContext, &packet) >= 0) {
+        if (packet.stream_index == videoStreamIndex) {
+            int64_t pts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+            if (pts != AV_NOPTS_VALUE) {
+                presentationTimes.push_back(pts);
+                if ((packet.flags & AV_PKT_FLAG_KEY) && packet.pos >= 0) {
+                    entries->push_back(KeyframeIndexEntry{pts, packet.pos, 0, packet.size, packet.flags});
+                }
+            }
+        }
+        av_packet_unref(&packet);
+    }
+    std::stable_sort(entries->begin(), entries->end(), [](const KeyframeIndexEntry& a, const KeyframeIndexEntry& b) {
+        return a.pts < b.pts;
+    });
+    std::sort(presentationTimes.begin(), presentationTimes.end());
+    for (KeyframeIndexEntry& entry : *entries) {
+        entry.frameNumber = std::lower_bound(presentationTimes.begin(), presentationTimes.end(), entry.pts) - presentationTimes.begin();
+    }
+}
 
-    return 0; // Success
+// Index an open input in memory, for when the sidecar can't be written (e.g. a read-only directory).
+// Other streams are discarded for the scan; the caller seeks afterwards.
+static bool scanKeyframeIndex(AVFormatContext* formatContext, int videoStreamIndex, KeyframeIndex* index) {
+    for (unsigned int i = 0; i < formatContext->nb_streams; ++i) {
+        if (int(i) != videoStreamIndex) {
+            formatContext->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+    scanKeyframes(formatContext, videoStreamIndex, &index->ownedEntries);
+    if (index->ownedEntries.empty()) {
+        return false;
+    }
+    KeyframeIndexHeader& header = index->ownedHeader;
+    header = KeyframeIndexHeader{};
+    header.streamIndex = videoStreamIndex;
+    header.timeBaseNum = formatContext->streams[videoStreamIndex]->time_base.num;
+    header.timeBaseDen = formatContext->streams[videoStreamIndex]->time_base.den;
+    header.count = uint32_t(index->ownedEntries.size());
+    index->header = &header;
+    index->entries = index->ownedEntries.data();
+    return true;
 }
 
-int generateThumbnail(const char* srcFilePath, const char* outputDirPath, const char* outputFileName, const char* outputFormat, int width, int height) {
+int buildKeyframeIndex(const char* srcFilePath) {
+    CallScope scope;
     AVFormatContext* formatContext = nullptr;
-    AVCodecContext* codecContext = nullptr;
-    AVFrame* frame = nullptr;
-    AVFrame* frameRGB = nullptr;
-    AVPacket packet;
-    struct SwsContext* swsContext = nullptr;
     int videoStreamIndex = -1;
-    int ret = 0;
 
-    // Open input file
-    if (avformat_open_input(&formatContext, srcFilePath, nullptr, nullptr) != 0) {
-        return -1; // Couldn't open file
+    struct stat srcStat{};
+    if (stat(srcFilePath, &srcStat) != 0) {
+        return 0; // Couldn't stat file
     }
 
-    // Retrieve stream information
+    // Open the input file for reading
+    enterPhase(MEDIA_PHASE_OPEN);
+    if (avformat_open_input(&formatContext, srcFilePath, nullptr, nullptr) != 0) {
+        return 0; // Couldn't open file
+    }
+    enterPhase(MEDIA_PHASE_PROBE);
     if (avformat_find_stream_info(formatContext, nullptr) < 0) {
-        avformat_close_input(&formatContext);
-        return -1; // Couldn't find stream information
+        closeInput(&formatContext);
+        return 0; // Couldn't find stream information
     }
 
-    // Find the first video stream
+    // Only the first video stream is indexed; the demuxer can drop everything else unread
     for (unsigned int i = 0; i < formatContext->nb_streams; ++i) {
-        if (formatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+        if (videoStreamIndex == -1 && formatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
             videoStreamIndex = int(i);
-            break;
+        } else {
+            formatContext->streams[i]->discard = AVDISCARD_ALL;
         }
     }
     if (videoStreamIndex == -1) {
-        avformat_close_input(&formatContext);
-        return -1; // Didn't find a video stream
+        closeInput(&formatContext);
+        return 0; // Didn't find a video stream
     }
 
-    // Get codec parameters and find decoder
-    AVCodecParameters* codecParameters = formatContext->streams[videoStreamIndex]->codecpar;
-    auto* codec = const_cast<AVCodec *>(avcodec_find_decoder(codecParameters->codec_id));
-    if (!codec) {
-        avformat_close_input(&formatContext);
-        return -1; // Codec not found
-    }
+    std::vector<KeyframeIndexEntry> entries;
+    scanKeyframes(formatContext, videoStreamIndex, &entries);
 
-    // Allocate codec context
-    codecContext = avcodec_alloc_context3(codec);
-    if (!codecContext) {
-        avformat_close_input(&formatContext);
-        return -1; // Could not allocate codec context
-    }
+    KeyframeIndexHeader header{};
+    memcpy(header.magic, keyframeIndexMagic, sizeof(keyframeIndexMagic));
+    header.version = keyframeIndexVersion;
+    header.fileSize = int64_t(srcStat.st_size);
+    header.fileModified = fileModifiedNanos(srcStat);
+    header.fileInode = int64_t(srcStat.st_ino);
+    header.streamIndex = videoStreamIndex;
+    header.timeBaseNum = formatContext->streams[videoStreamIndex]->time_base.num;
+    header.timeBaseDen = formatContext->streams[videoStreamIndex]->time_base.den;
+    header.count = uint32_t(entries.size());
+    closeInput(&formatContext);
 
-    // Copy codec parameters to codec context
-    if (avcodec_parameters_to_context(codecContext, codecParameters) < 0) {
-        avcodec_free_context(&codecContext);
-        avformat_close_input(&formatContext);
-        return -1; // Could not copy codec parameters
+    // Write to a uniquely named temporary file and rename it into place, so readers never map a
+    // partial index and concurrent builders of the same index don't write into each other's file
+    char indexFilePath[1024];
+    char tempFilePath[1040];
+    keyframeIndexPath(srcFilePath, indexFilePath, sizeof(indexFilePath));
+    snprintf(tempFilePath, sizeof(tempFilePath), "%s.XXXXXX", indexFilePath);
+    enterPhase(MEDIA_PHASE_WRITE);
+    int fd = mkstemp(tempFilePath);
+    if (fd < 0) {
+        return 0; // Couldn't create index file
     }
-
-    // Open codec
-    if (avcodec_open2(codecContext, codec, nullptr) < 0) {
-        avcodec_free_context(&codecContext);
-        avformat_close_input(&formatContext);
-        return -1; // Could not open codec
+    fchmod(fd, 0644); // mkstemp creates the file owner-only
+    FILE* file = fdopen(fd, "wb");
+    if (!file) {
+        close(fd);
+        remove(tempFilePath);
+        return 0; // Couldn't create index file
     }
-
-    // Allocate frames
-    frame = av_frame_alloc();
-    frameRGB = av_frame_alloc();
-    if (!frame || !frameRGB) {
-        avcodec_free_context(&codecContext);
-        avformat_close_input(&formatContext);
-        return -1; // Could not allocate frame
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   (entries.empty() || fwrite(entries.data(), sizeof(KeyframeIndexEntry), entries.size(), file) == entries.size());
+    if (fclose(file) != 0 || !written || rename(tempFilePath, indexFilePath) != 0) {
+        remove(tempFilePath);
+        return 0; // Failed to write index file
     }
+    return 1;
+}
 
-    // Allocate buffer for RGB frame
-    int numBytes = av_image_get_buffer_size(AV_PIX_FMT_RGB24, width, height, 1);
-    auto* buffer = (uint8_t*)av_malloc(numBytes * sizeof(uint8_t));
-    if (!buffer) {
-        av_frame_free(&frame);
-        av_frame_free(&frameRGB);
-        avcodec_free_context(&codecContext);
-        avformat_close_input(&formatContext);
-        return -1; // Could not allocate buffer
-    }
+// Cancellation and deadlines. A CallGuard fixes a call's MediaCallControl when the call starts;
+// libavformat polls it through interrupt_callback, input reads poll it, and the packet and decode
+// loops check it once per packet.
+struct MediaCancelToken {
+    std::atomic<bool> cancelled{false};
+};
 
-    // Set up the frameRGB with the buffer
-    av_image_fill_arrays(frameRGB->data, frameRGB->linesize, buffer, AV_PIX_FMT_RGB24, width, height, 1);
+struct CallGuard {
+    const MediaCancelToken* token = nullptr;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
 
-    // Initialize SWS context for software scaling
-    swsContext = sws_getContext(codecContext->width, codecContext->height, codecContext->pix_fmt, width, height, AV_PIX_FMT_RGB24, SWS_BILINEAR, nullptr, nullptr, nullptr);
-    if (!swsContext) {
-        av_free(buffer);
-        av_frame_free(&frame);
-        av_frame_free(&frameRGB);
-        avcodec_free_context(&codecContext);
-        avformat_close_input(&formatContext);
-        return -1; // Could not initialize SWS context
+    bool stopped() const {
+        if (token && token->cancelled.load(std::memory_order_relaxed)) {
+            return true;
+        }
+        return deadline != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= deadline;
     }
+};
 
-    // Read frames and save the first frame as a thumbnail
-    while (av_read_frame(formatContext, &packet) >= 0) {
-        if (packet.stream_index == videoStreamIndex) {
-            if (avcodec_send_packet(codecContext, &packet) == 0) {
-                if (avcodec_receive_frame(codecContext, frame) == 0) {
-                    // Convert the image from its native format to RGB
-                    sws_scale(swsContext, (uint8_t const* const*)frame->data, frame->linesize, 0, codecContext->height, frameRGB->data, frameRGB->linesize);
-
-                    // Construct thumbnail file path
-                    char thumbnailFilePath[1024];
-                    snprintf(thumbnailFilePath, sizeof(thumbnailFilePath), "%s/%s.%s", outputDirPath, outputFileName, outputFormat);
-
-                    // Save as JPEG
-                    if (strcmp(outputFormat, "jpeg") == 0 || strcmp(outputFormat, "jpg") == 0) {
-                        if (saveAsJPEG(thumbnailFilePath, frameRGB->data[0], width, height, frameRGB->linesize[0]) == 0) {
-                            ret = 1; // Success
-                        }
-                    }
-                    break;
-                }
-            }
+static CallGuard makeCallGuard(const MediaCallControl* control) {
+    CallGuard guard;
+    if (control) {
+        guard.token = control->cancelToken;
+        if (control->timeoutSeconds > 0) {
+            guard.deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(control->timeoutSeconds));
         }
-        av_packet_unref(&packet);
     }
+    return guard;
+}
 
-    // Free resources
-    sws_freeContext(swsContext);
-    av_free(buffer);
-    av_frame_free(&frame);
-    av_frame_free(&frameRGB);
-    avcodec_free_context(&codecContext);
-    avformat_close_input(&formatContext);
+static int interruptCallGuard(void* opaque) {
+    return static_cast<const CallGuard*>(opaque)->stopped() ? 1 : 0;
+}
 
-    return ret;
+// Make libavformat's blocking waits on a context give up once the guard trips
+static void setInterruptGuard(AVFormatContext* formatContext, const CallGuard* guard) {
+    formatContext->interrupt_callback.callback = interruptCallGuard;
+    formatContext->interrupt_callback.opaque = const_cast<CallGuard*>(guard);
 }
 
-char** generateThumbnails(const char* srcFilePath, const char* outputDirPath, int width, int height, int numThumbnails) {
-    char** thumbnails = new char*[numThumbnails];
-    AVFormatContext* formatContext = nullptr;
-    AVCodecContext* codecContext = nullptr;
-    AVFrame* frame = nullptr;
-    AVFrame* frameRGB = nullptr;
-    AVPacket packet;
-    struct SwsContext* swsContext = nullptr;
-    int videoStreamIndex = -1;
+MediaCancelToken* createCancelToken() {
+    return new MediaCancelToken();
+}
 
-    // Open input file
-    if (avformat_open_input(&formatContext, srcFilePath, nullptr, nullptr) != 0) {
-        return thumbnails; // Couldn't open file
+void cancelMediaCalls(MediaCancelToken* token) {
+    if (token) {
+        token->cancelled = true;
     }
+}
 
-    // Retrieve stream information
-    if (avformat_find_stream_info(formatContext, nullptr) < 0) {
-        avformat_close_input(&formatContext);
-        return thumbnails; // Couldn't find stream information
-    }
+void releaseCancelToken(MediaCancelToken* token) {
+    delete token;
+}
 
-    // Find the first video stream
-    for (unsigned int i = 0; i < formatContext->nb_streams; ++i) {
-        if (formatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-            videoStreamIndex = int(i);
-            break;
-        }
+// File I/O behind an AVIOContext with a caller-chosen buffer size. libavformat's file protocol
+// reads and writes in small chunks; large buffers here turn a remux into a few big read()/write()
+// calls per megabyte instead of hundreds.
+struct FileIO {
+    int fd;
+    std::atomic<int64_t>* transferred; // Optional byte counter for progress reporting
+    bool ownsFd = true;                // False for descriptors the caller handed in
+    int64_t baseOffset = 0;            // Where the output starts in fd; positions are relative to it
+    MediaWriteCallback writeCallback = nullptr; // Caller-supplied sink used instead of fd
+    MediaSeekCallback seekCallback = nullptr;
+    void* user = nullptr;
+    const CallGuard* guard = nullptr;  // Reads fail once it trips, even inside a demuxer's own loops
+};
+
+static int readFileIO(void* opaque, uint8_t* buf, int size) {
+    auto* io = static_cast<FileIO*>(opaque);
+    if (io->guard && io->guard->stopped()) {
+        return AVERROR_EXIT;
+    }
+    ssize_t n;
+    do {
+        n = read(io->fd, buf, size_t(size));
+    } while (n < 0 && errno == EINTR);
+    if (n == 0) {
+        return AVERROR_EOF;
+    }
+    if (n > 0 && io->transferred) {
+        io->transferred->fetch_add(n, std::memory_order_relaxed);
+    }
+    return n < 0 ? AVERROR(errno) : int(n);
+}
+
+static int writeFileIO(void* opaque, const uint8_t* buf, int size) {
+    auto* io = static_cast<FileIO*>(opaque);
+    if (io->writeCallback) {
+        int n = io->writeCallback(io->user, buf, size);
+        if (n > 0 && io->transferred) {
+            io->transferred->fetch_add(n, std::memory_order_relaxed);
+        }
+        return n < 0 ? n : size;
+    }
+    int written = 0;
+    while (written < size) {
+        ssize_t n = write(io->fd, buf + written, size_t(size - written));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return AVERROR(errno);
+        }
+        written += int(n);
+    }
+    if (io->transferred) {
+        io->transferred->fetch_add(written, std::memory_order_relaxed);
+    }
+    return written;
+}
+
+static int64_t seekFileIO(void* opaque, int64_t offset, int whence) {
+    auto* io = static_cast<FileIO*>(opaque);
+    if (io->seekCallback) {
+        int64_t position = io->seekCallback(io->user, offset, whence & ~AVSEEK_FORCE);
+        return position < 0 ? AVERROR(ESPIPE) : position;
+    }
+    if (whence == AVSEEK_SIZE) {
+        struct stat fileStat{};
+        return fstat(io->fd, &fileStat) == 0 ? int64_t(fileStat.st_size) - io->baseOffset : AVERROR(errno);
+    }
+    whence &= ~AVSEEK_FORCE;
+    off_t position = lseek(io->fd, off_t(whence == SEEK_SET ? io->baseOffset + offset : offset), whence);
+    return position < 0 ? AVERROR(errno) : int64_t(position) - io->baseOffset;
+}
+
+// Open a file for the remuxer. Local files get an fd-backed context with a bufferSize buffer; any
+// other URL (http://, rtmp://, pipe:, ...) goes through avio_open2 and its protocol, with the
+// guard as interrupt callback and no byte counting.
+static AVIOContext* openFileIO(const char* filePath, bool write, int bufferSize, std::atomic<int64_t>* transferred = nullptr, const CallGuard* guard = nullptr) {
+    const char* protocol = avio_find_protocol_name(filePath);
+    if (!protocol || strcmp(protocol, "file") != 0) {
+        AVIOContext* context = nullptr;
+        AVIOInterruptCB interrupt{interruptCallGuard, const_cast<CallGuard*>(guard)};
+        AVDictionary* protocolOptions = nullptr;
+        av_dict_set_int(&protocolOptions, "buffer_size", bufferSize, 0);
+        int ret = avio_open2(&context, filePath, write ? AVIO_FLAG_WRITE : AVIO_FLAG_READ, guard ? &interrupt : nullptr, &protocolOptions);
+        av_dict_free(&protocolOptions);
+        return ret < 0 ? nullptr : context;
+    }
+    if (strncmp(filePath, "file:", 5) == 0) {
+        filePath += 5;
+    }
+
+    int fd = write ? open(filePath, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(filePath, O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    auto* buffer = (unsigned char*)av_malloc(size_t(bufferSize));
+    auto* io = new FileIO{fd, transferred};
+    io->guard = guard;
+    AVIOContext* context = buffer ? avio_alloc_context(buffer, bufferSize, write ? 1 : 0, io, write ? nullptr : readFileIO, write ? writeFileIO : nullptr, seekFileIO) : nullptr;
+    if (!context) {
+        av_free(buffer);
+        delete io;
+        close(fd);
+        return nullptr;
+    }
+    return context;
+}
+
+// Where a streaming remux writes instead of a file: a caller-owned fd, or write/seek callbacks
+struct RemuxSink {
+    int fd = -1;
+    MediaWriteCallback write = nullptr;
+    MediaSeekCallback seek = nullptr;
+    void* user = nullptr;
+};
+
+// A writing AVIOContext over a sink, seekable only when the sink is (a regular file, or a seek
+// callback). The fd stays open when the context is closed.
+static AVIOContext* openSinkIO(const RemuxSink* sink, int bufferSize, std::atomic<int64_t>* transferred) {
+    auto* io = new FileIO{sink->fd, transferred};
+    io->ownsFd = false;
+    io->writeCallback = sink->write;
+    io->seekCallback = sink->seek;
+    io->user = sink->user;
+    // An fd may already be part-way into a file (an appended file, a shared memfd): the output starts
+    // at its current position. With O_APPEND every write lands at the end, so seeking back is useless.
+    bool seekable = sink->seek != nullptr;
+    if (!sink->write) {
+        io->baseOffset = int64_t(lseek(sink->fd, 0, SEEK_CUR));
+        int flags = fcntl(sink->fd, F_GETFL);
+        seekable = io->baseOffset >= 0 && flags >= 0 && !(flags & O_APPEND);
+        io->baseOffset = std::max<int64_t>(io->baseOffset, 0);
+    }
+
+    auto* buffer = (unsigned char*)av_malloc(size_t(bufferSize));
+    AVIOContext* context = buffer ? avio_alloc_context(buffer, bufferSize, 1, io, nullptr, writeFileIO, seekable ? seekFileIO : nullptr) : nullptr;
+    if (!context) {
+        av_free(buffer);
+        delete io;
+        return nullptr;
+    }
+    return context;
+}
+
+// Flush (when writing), close the file and free the context
+static int closeFileIO(AVIOContext** context) {
+    if (!*context) {
+        return 0;
+    }
+    if ((*context)->read_packet != readFileIO && (*context)->write_packet != writeFileIO) {
+        return avio_closep(context); // Opened by avio_open2 for a non-file URL
+    }
+    int ret = 0;
+    if ((*context)->write_flag) {
+        avio_flush(*context);
+        ret = (*context)->error;
+    }
+    auto* io = static_cast<FileIO*>((*context)->opaque);
+    if (io->ownsFd && close(io->fd) != 0 && ret == 0) {
+        ret = AVERROR(errno);
+    }
+    delete io;
+    av_freep(&(*context)->buffer);
+    avio_context_free(context);
+    return ret;
+}
+
+// Live counters for a running remux, updated from the remux thread and read from anywhere
+struct RemuxMonitor {
+    std::atomic<int64_t> bytesRead{0};
+    std::atomic<int64_t> bytesWritten{0};
+    std::atomic<int64_t> processedTime{0}; // Highest packet end time seen, microseconds
+    std::atomic<int64_t> duration{0};      // Input duration, microseconds, 0 when unknown
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point lastReport;
+    std::function<void()> report;          // Called from the remux thread at most every 250 ms
+};
+
+// Forward a monitor's reports to a call's progress callback as the fraction of the input done
+static void reportCallProgress(RemuxMonitor* monitor, const MediaCallControl* control) {
+    monitor->report = [monitor, control]() {
+        int64_t duration = monitor->duration.load(std::memory_order_relaxed);
+        double fraction = duration > 0 ? double(monitor->processedTime.load(std::memory_order_relaxed)) / double(duration) : 0;
+        control->progress(std::min(1.0, fraction), control->user);
+    };
+}
+
+// Everything one remux owns: the input and output, which input streams map to which output
+// streams (-1 when dropped) and the bitstream filter, if any, each copied stream goes through
+struct RemuxSession {
+    AVFormatContext* input = nullptr;
+    AVFormatContext* output = nullptr;
+    AVIOContext* inputIO = nullptr;
+    AVIOContext* outputIO = nullptr;
+    std::vector<int> streamMap;
+    std::vector<AVBSFContext*> filters;
+    RemuxMonitor* monitor = nullptr;
+    const CallGuard* guard = nullptr;
+
+    // Trimming: packets are rebased so trimOffset (the keyframe the copy starts on) becomes zero,
+    // and each stream stops once it reaches trimEnd. All in AV_TIME_BASE, absolute input time.
+    bool trimming = false;
+    int trimAnchorStream = -1;
+    int64_t trimOffset = AV_NOPTS_VALUE;
+    int64_t trimEnd = INT64_MAX;
+    std::vector<bool> streamFinished;
+
+    // Concatenation: packets are shifted by timestampOffset (AV_TIME_BASE; AV_NOPTS_VALUE means
+    // derive it from the next packet) so each input continues where outputEnd, the furthest packet
+    // end written so far, left off
+    bool concatenating = false;
+    int64_t timestampOffset = 0;
+    int64_t outputEnd = 0;
+};
+
+// Per-call extras for remuxMedia beyond the public RemuxOptions
+struct RemuxTask {
+    AVDictionary** muxerOptions = nullptr;
+    RemuxMonitor* monitor = nullptr;
+    double trimStart = -1; // Seconds from the start of the input; < 0 copies from the start
+    double trimEnd = -1;   // Seconds from the start of the input; < 0 copies to the end
+    const RemuxSink* sink = nullptr; // Write here; destFilePath then only names the output
+    const CallGuard* guard = nullptr; // Instead of one made from RemuxOptions::control
+};
+
+static const int defaultRemuxBufferSize = 1 << 20;
+
+static void closeRemuxSession(RemuxSession* session) {
+    for (AVBSFContext*& filter : session->filters) {
+        av_bsf_free(&filter);
+    }
+    session->filters.clear();
+    closeInput(&session->input);
+    closeFileIO(&session->inputIO);
+    avformat_free_context(session->output);
+    session->output = nullptr;
+    closeFileIO(&session->outputIO);
+}
+
+static int openRemuxInput(RemuxSession* session, const char* srcFilePath, const RemuxOptions* options) {
+    int bufferSize = options && options->readBufferSize > 0 ? options->readBufferSize : defaultRemuxBufferSize;
+    session->inputIO = openFileIO(srcFilePath, false, bufferSize, session->monitor ? &session->monitor->bytesRead : nullptr, session->guard);
+    session->input = avformat_alloc_context();
+    if (!session->inputIO || !session->input) {
+        return -1; // Couldn't open file
+    }
+    session->input->pb = session->inputIO;
+    session->input->flags |= AVFMT_FLAG_CUSTOM_IO;
+    if (session->guard) {
+        setInterruptGuard(session->input, session->guard);
+    }
+    enterPhase(MEDIA_PHASE_OPEN);
+    if (avformat_open_input(&session->input, srcFilePath, nullptr, nullptr) != 0) {
+        return -1; // Couldn't open file (the context is freed by avformat_open_input)
+    }
+    enterPhase(MEDIA_PHASE_PROBE);
+    if (avformat_find_stream_info(session->input, nullptr) < 0) {
+        return -1; // Couldn't find stream information
+    }
+    if (session->monitor && session->input->duration != AV_NOPTS_VALUE) {
+        session->monitor->duration = session->input->duration;
+    }
+    return 0;
+}
+
+static int streamTypeFlag(enum AVMediaType type) {
+    switch (type) {
+        case AVMEDIA_TYPE_VIDEO: return MEDIA_STREAM_VIDEO;
+        case AVMEDIA_TYPE_AUDIO: return MEDIA_STREAM_AUDIO;
+        case AVMEDIA_TYPE_SUBTITLE: return MEDIA_STREAM_SUBTITLE;
+        case AVMEDIA_TYPE_DATA: return MEDIA_STREAM_DATA;
+        case AVMEDIA_TYPE_ATTACHMENT: return MEDIA_STREAM_ATTACHMENT;
+        default: return 0;
+    }
+}
+
+// Pick the bitstream filter a stream needs to be valid in the output container, or nullptr
+static const char* remuxBitstreamFilter(const AVCodecParameters* codecParameters, const AVOutputFormat* outputFormat) {
+    bool annexB = strcmp(outputFormat->name, "mpegts") == 0 || strcmp(outputFormat->name, "h264") == 0 || strcmp(outputFormat->name, "hevc") == 0;
+    bool lengthPrefixed = codecParameters->extradata_size > 0 && codecParameters->extradata[0] == 1;
+    if (annexB && lengthPrefixed && codecParameters->codec_id == AV_CODEC_ID_H264) {
+        return "h264_mp4toannexb";
+    }
+    if (annexB && lengthPrefixed && codecParameters->codec_id == AV_CODEC_ID_HEVC) {
+        return "hevc_mp4toannexb";
+    }
+    // AAC without an AudioSpecificConfig is ADTS-framed; only TS and raw ADTS carry that as is
+    bool adtsContainer = strcmp(outputFormat->name, "mpegts") == 0 || strcmp(outputFormat->name, "adts") == 0;
+    if (!adtsContainer && codecParameters->codec_id == AV_CODEC_ID_AAC && codecParameters->extradata_size == 0) {
+        return "aac_adtstoasc";
+    }
+    return nullptr;
+}
+
+// Returned by the remux setup when the output container can't hold a selected audio/video codec
+static const int remuxIncompatible = -2;
+
+// Add an output stream that stream-copies input stream inputIndex, through whatever bitstream
+// filter the output container needs unless bitstreamFilters is false
+static int addCopyStream(RemuxSession* session, unsigned int inputIndex, bool bitstreamFilters) {
+    AVStream* inputStream = session->input->streams[inputIndex];
+    AVStream* outputStream = avformat_new_stream(session->output, nullptr);
+    if (!outputStream) {
+        return -1; // Failed to create new stream
+    }
+    const AVCodecParameters* outputParameters = inputStream->codecpar;
+
+    const char* filterName = bitstreamFilters ? remuxBitstreamFilter(inputStream->codecpar, session->output->oformat) : nullptr;
+    const AVBitStreamFilter* filter = filterName ? av_bsf_get_by_name(filterName) : nullptr;
+    if (filter) {
+        AVBSFContext* bsf = nullptr;
+        if (av_bsf_alloc(filter, &bsf) < 0) {
+            return -1; // Failed to allocate bitstream filter
+        }
+        session->filters[inputIndex] = bsf;
+        if (avcodec_parameters_copy(bsf->par_in, inputStream->codecpar) < 0) {
+            return -1; // Failed to copy parameters
+        }
+        bsf->time_base_in = inputStream->time_base;
+        if (av_bsf_init(bsf) < 0) {
+            return -1; // Failed to initialize bitstream filter
+        }
+        outputParameters = bsf->par_out;
+    }
+
+    if (avcodec_parameters_copy(outputStream->codecpar, outputParameters) < 0) {
+        return -1; // Failed to copy parameters
+    }
+    outputStream->codecpar->codec_tag = 0;
+    outputStream->time_base = inputStream->time_base;
+    outputStream->disposition = inputStream->disposition;
+
+    // Copy the frame rate from the input stream to the output stream
+    outputStream->avg_frame_rate = inputStream->avg_frame_rate;
+    session->streamMap[inputIndex] = outputStream->index;
+    return 0;
+}
+
+// The segmenting muxers don't answer avformat_query_codec (it returns < 0 for them): HLS writes
+// subtitles only as WebVTT segments and DASH has no subtitle support, so decide for them here
+static bool subtitleFitsOutput(const AVOutputFormat* outputFormat, enum AVCodecID codecId) {
+    if (strcmp(outputFormat->name, "hls") == 0) {
+        return codecId == AV_CODEC_ID_WEBVTT;
+    }
+    if (strcmp(outputFormat->name, "dash") == 0) {
+        return false;
+    }
+    return avformat_query_codec(outputFormat, codecId, FF_COMPLIANCE_NORMAL) != 0;
+}
+
+// Create output streams for the selected input streams and tell the demuxer to skip the rest
+static int addRemuxStreams(RemuxSession* session, const RemuxOptions* options) {
+    AVFormatContext* input = session->input;
+    AVFormatContext* output = session->output;
+    bool explicitStreams = options && options->streamIndices && options->numStreamIndices > 0;
+    int streamTypes = options && options->streamTypes ? options->streamTypes : MEDIA_STREAM_VIDEO | MEDIA_STREAM_AUDIO | MEDIA_STREAM_SUBTITLE;
+
+    session->streamMap.assign(input->nb_streams, -1);
+    session->filters.assign(input->nb_streams, nullptr);
+    for (unsigned int i = 0; i < input->nb_streams; ++i) {
+        AVStream* inputStream = input->streams[i];
+        bool selected;
+        if (explicitStreams) {
+            selected = std::find(options->streamIndices, options->streamIndices + options->numStreamIndices, int(i)) != options->streamIndices + options->numStreamIndices;
+        } else {
+            selected = (streamTypeFlag(inputStream->codecpar->codec_type) & streamTypes) != 0;
+            // Subtitles are only taken by default when the container can hold their codec
+            if (selected && !(options && options->streamTypes) && inputStream->codecpar->codec_type == AVMEDIA_TYPE_SUBTITLE &&
+                !subtitleFitsOutput(output->oformat, inputStream->codecpar->codec_id)) {
+                selected = false;
+            }
+        }
+        if (!selected) {
+            inputStream->discard = AVDISCARD_ALL;
+            continue;
+        }
+
+        // Stream-copying a codec the container can't hold only produces a broken file
+        enum AVMediaType type = inputStream->codecpar->codec_type;
+        if ((type == AVMEDIA_TYPE_VIDEO || type == AVMEDIA_TYPE_AUDIO) &&
+            avformat_query_codec(output->oformat, inputStream->codecpar->codec_id, FF_COMPLIANCE_NORMAL) == 0) {
+            return remuxIncompatible;
+        }
+        if (addCopyStream(session, i, !(options && options->disableBitstreamFilters)) < 0) {
+            return -1;
+        }
+    }
+    return output->nb_streams > 0 ? 0 : -1;
+}
+
+// Open the output file, unless the session already has a sink to write to
+static int openRemuxOutputFile(RemuxSession* session, const char* destFilePath, const RemuxOptions* options) {
+    if (session->output->oformat->flags & AVFMT_NOFILE) {
+        return session->outputIO ? -1 : 0; // The muxer opens its own files, so it can't use a sink
+    }
+    int bufferSize = options && options->writeBufferSize > 0 ? options->writeBufferSize : defaultRemuxBufferSize;
+    if (!session->outputIO) {
+        session->outputIO = openFileIO(destFilePath, true, bufferSize, session->monitor ? &session->monitor->bytesWritten : nullptr, session->guard);
+    }
+    if (!session->outputIO) {
+        return -1; // Failed to open output file
+    }
+    session->output->pb = session->outputIO;
+    return 0;
+}
+
+static int openRemuxOutput(RemuxSession* session, const char* destFilePath, const char* outputFormat, const RemuxOptions* options) {
+    avformat_alloc_output_context2(&session->output, nullptr, outputFormat, destFilePath);
+    if (!session->output) {
+        return -1; // Couldn't create output context
+    }
+    int ret = addRemuxStreams(session, options);
+    if (ret < 0) {
+        return ret; // No usable streams
+    }
+    return openRemuxOutputFile(session, destFilePath, options);
+}
+
+// Write one input packet (in input time base) to its output stream, through its bitstream filter
+static int writeRemuxPacket(RemuxSession* session, AVPacket* packet) {
+    int inputIndex = packet->stream_index;
+    int outputIndex = session->streamMap[inputIndex];
+    AVRational inputTimeBase = session->input->streams[inputIndex]->time_base;
+    AVStream* outputStream = session->output->streams[outputIndex];
+    AVBSFContext* filter = session->filters[inputIndex];
+
+    if (!filter) {
+        av_packet_rescale_ts(packet, inputTimeBase, outputStream->time_base);
+        packet->stream_index = outputIndex;
+        packet->pos = -1;
+        return av_interleaved_write_frame(session->output, packet);
+    }
+
+    int ret = av_bsf_send_packet(filter, packet);
+    if (ret < 0) {
+        av_packet_unref(packet);
+        return ret;
+    }
+    while ((ret = av_bsf_receive_packet(filter, packet)) == 0) {
+        av_packet_rescale_ts(packet, filter->time_base_out, outputStream->time_base);
+        packet->stream_index = outputIndex;
+        packet->pos = -1;
+        ret = av_interleaved_write_frame(session->output, packet);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+// Record how far into the input a packet reaches and report progress if it's been a while
+static void updateRemuxMonitor(RemuxMonitor* monitor, const AVStream* stream, const AVPacket* packet) {
+    int64_t timestamp = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+    if (timestamp != AV_NOPTS_VALUE) {
+        int64_t start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+        int64_t end = av_rescale_q(timestamp - start + packet->duration, stream->time_base, AV_TIME_BASE_Q);
+        if (end > monitor->processedTime.load(std::memory_order_relaxed)) {
+            monitor->processedTime.store(end, std::memory_order_relaxed);
+        }
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (monitor->report && now - monitor->lastReport >= std::chrono::milliseconds(250)) {
+        monitor->lastReport = now;
+        monitor->report();
+    }
+}
+
+// Seek the input to the keyframe at or before startTime (seconds) and set up trimming. The first
+// selected video stream (not cover art, which has no samples to seek) anchors the cut; audio-only
+// inputs cut on any packet.
+static int seekRemuxInput(RemuxSession* session, const char* srcFilePath, double startTime, double endTime) {
+    AVFormatContext* input = session->input;
+    int64_t inputStart = input->start_time != AV_NOPTS_VALUE ? input->start_time : 0;
+
+    session->trimming = true;
+    session->streamFinished.assign(input->nb_streams, false);
+    session->trimEnd = endTime >= 0 ? inputStart + int64_t(endTime * AV_TIME_BASE) : INT64_MAX;
+    for (unsigned int i = 0; i < input->nb_streams; ++i) {
+        const AVStream* stream = input->streams[i];
+        if (session->streamMap[i] >= 0 && stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && !(stream->disposition & AV_DISPOSITION_ATTACHED_PIC)) {
+            session->trimAnchorStream = int(i);
+            break;
+        }
+    }
+    if (startTime <= 0) {
+        return 0;
+    }
+
+    int64_t target = inputStart + int64_t(startTime * AV_TIME_BASE);
+    if (session->trimAnchorStream < 0) {
+        return av_seek_frame(input, -1, target, AVSEEK_FLAG_BACKWARD);
+    }
+    AVStream* anchor = input->streams[session->trimAnchorStream];
+    KeyframeIndex keyframeIndex;
+    loadKeyframeIndex(srcFilePath, &keyframeIndex);
+    int ret = seekVideoStream(input, session->trimAnchorStream, av_rescale_q(target, AV_TIME_BASE_Q, anchor->time_base), &keyframeIndex);
+    unloadKeyframeIndex(&keyframeIndex);
+    return ret;
+}
+
+// Apply the trim window to a packet: returns false when it should be dropped
+static bool trimRemuxPacket(RemuxSession* session, AVPacket* packet) {
+    const AVStream* stream = session->input->streams[packet->stream_index];
+    if (stream->disposition & AV_DISPOSITION_ATTACHED_PIC) {
+        // Cover art is one packet outside the timeline: keep it once and don't let it start the cut
+        bool first = !session->streamFinished[packet->stream_index];
+        session->streamFinished[packet->stream_index] = true;
+        return first;
+    }
+    int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+    if (pts == AV_NOPTS_VALUE || session->streamFinished[packet->stream_index]) {
+        return false;
+    }
+    int64_t time = av_rescale_q(pts, stream->time_base, AV_TIME_BASE_Q);
+
+    // The copy starts at the anchor's first packet after the seek, i.e. the keyframe
+    if (session->trimOffset == AV_NOPTS_VALUE) {
+        if (session->trimAnchorStream >= 0 && packet->stream_index != session->trimAnchorStream) {
+            return false;
+        }
+        session->trimOffset = time;
+    }
+    if (time < session->trimOffset && packet->stream_index != session->trimAnchorStream) {
+        return false; // Other streams' packets from before the keyframe
+    }
+
+    // Stop a stream once its decode order passes the end; frames reordered past it are dropped
+    int64_t dts = packet->dts != AV_NOPTS_VALUE ? av_rescale_q(packet->dts, stream->time_base, AV_TIME_BASE_Q) : time;
+    if (dts >= session->trimEnd) {
+        session->streamFinished[packet->stream_index] = true;
+    }
+    if (time >= session->trimEnd) {
+        return false;
+    }
+
+    int64_t offset = av_rescale_q(session->trimOffset, AV_TIME_BASE_Q, stream->time_base);
+    if (packet->pts != AV_NOPTS_VALUE) {
+        packet->pts -= offset;
+    }
+    if (packet->dts != AV_NOPTS_VALUE) {
+        packet->dts -= offset;
+    }
+    return true;
+}
+
+// Sparse streams (subtitles, data, cover art) may never produce a packet past the end, so only
+// audio and video decide when the copy is done
+static bool remuxTrimFinished(const RemuxSession* session) {
+    for (size_t i = 0; i < session->streamMap.size(); ++i) {
+        const AVStream* stream = session->input->streams[i];
+        enum AVMediaType type = stream->codecpar->codec_type;
+        bool attachedPic = stream->disposition & AV_DISPOSITION_ATTACHED_PIC;
+        if (session->streamMap[i] >= 0 && ((type == AVMEDIA_TYPE_VIDEO && !attachedPic) || type == AVMEDIA_TYPE_AUDIO) && !session->streamFinished[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Move a packet onto the concatenated timeline and extend the output end past it
+static void offsetRemuxPacket(RemuxSession* session, AVPacket* packet) {
+    const AVStream* stream = session->input->streams[packet->stream_index];
+    if (session->timestampOffset == AV_NOPTS_VALUE) {
+        // The first packet of a new input, usually the earliest decode timestamp in it
+        int64_t start = session->input->start_time != AV_NOPTS_VALUE ? session->input->start_time : 0;
+        int64_t first = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+        if (first != AV_NOPTS_VALUE) {
+            start = std::min(start, av_rescale_q(first, stream->time_base, AV_TIME_BASE_Q));
+        }
+        session->timestampOffset = session->outputEnd - start;
+    }
+    int64_t offset = av_rescale_q(session->timestampOffset, AV_TIME_BASE_Q, stream->time_base);
+    if (packet->pts != AV_NOPTS_VALUE) {
+        packet->pts += offset;
+    }
+    if (packet->dts != AV_NOPTS_VALUE) {
+        packet->dts += offset;
+    }
+    int64_t last = std::max(packet->pts != AV_NOPTS_VALUE ? packet->pts : INT64_MIN, packet->dts != AV_NOPTS_VALUE ? packet->dts : INT64_MIN);
+    if (last != INT64_MIN) {
+        session->outputEnd = std::max(session->outputEnd, av_rescale_q(last + packet->duration, stream->time_base, AV_TIME_BASE_Q));
+    }
+}
+
+// Copy every selected packet from input to output, then drain the bitstream filters
+static int copyRemuxPackets(RemuxSession* session) {
+    enterPhase(MEDIA_PHASE_COPY);
+    AVPacket packet;
+    while (!(session->guard && session->guard->stopped()) && av_read_frame(session->input, &packet) >= 0) {
+        if (packet.stream_index < 0 || packet.stream_index >= int(session->streamMap.size()) || session->streamMap[packet.stream_index] < 0) {
+            av_packet_unref(&packet);
+            continue;
+        }
+        if (session->trimming && !trimRemuxPacket(session, &packet)) {
+            av_packet_unref(&packet);
+            if (remuxTrimFinished(session)) {
+                break; // Everything past the end is left unread
+            }
+            continue;
+        }
+        if (session->concatenating) {
+            offsetRemuxPacket(session, &packet);
+        }
+        if (session->monitor) {
+            updateRemuxMonitor(session->monitor, session->input->streams[packet.stream_index], &packet);
+        }
+        // A single bad packet (e.g. non-monotonic DTS) is dropped by the muxer; only I/O errors abort
+        writeRemuxPacket(session, &packet);
+        av_packet_unref(&packet);
+        if (session->output->pb && session->output->pb->error < 0) {
+            return session->output->pb->error;
+        }
+    }
+    if (session->guard && session->guard->stopped()) {
+        return AVERROR_EXIT; // Cancelled or out of time, not the end of the input
+    }
+    for (size_t i = 0; i < session->filters.size(); ++i) {
+        AVBSFContext* filter = session->filters[i];
+        if (filter && av_bsf_send_packet(filter, nullptr) == 0) {
+            AVPacket* drained = av_packet_alloc();
+            if (!drained) {
+                return AVERROR(ENOMEM);
+            }
+            while (av_bsf_receive_packet(filter, drained) == 0) {
+                av_packet_rescale_ts(drained, filter->time_base_out, session->output->streams[session->streamMap[i]]->time_base);
+                drained->stream_index = session->streamMap[i];
+                av_interleaved_write_frame(session->output, drained);
+            }
+            av_packet_free(&drained);
+        }
+    }
+    return 0;
+}
+
+static bool isMovFamily(const AVOutputFormat* outputFormat) {
+    static const char* const names[] = {"mp4", "mov", "ipod", "3gp", "3g2", "psp", "ismv", "f4v", nullptr};
+    for (const char* const* name = names; *name; ++name) {
+        if (strcmp(outputFormat->name, *name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Estimate the moov atom size for the copied streams so it can be reserved ahead of mdat. Per
+// sample the sample tables take up to 4 (stsz) + 8 (stts) + 8 (ctts) + 4 (stss) bytes; each chunk
+// adds 8 (co64) + 12 (stsc). The muxer starts a new chunk whenever another stream's packet comes
+// in between, so with interleaved audio and video nearly every sample is its own chunk; that is
+// what's assumed. Sample counts come from the input's nb_frames, or duration times the
+// frame/packet rate when that's missing, with a quarter on top for estimation error.
+static int64_t estimateMoovSize(const RemuxSession* session) {
+    int64_t size = 4096;
+    for (unsigned int i = 0; i < session->input->nb_streams; ++i) {
+        if (session->streamMap[i] < 0) {
+            continue;
+        }
+        const AVStream* stream = session->input->streams[i];
+        double duration = stream->duration != AV_NOPTS_VALUE ? double(stream->duration) * av_q2d(stream->time_base)
+                        : session->input->duration != AV_NOPTS_VALUE ? double(session->input->duration) / AV_TIME_BASE : 0;
+        int64_t samples = stream->nb_frames;
+        if (samples <= 0 && stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && stream->avg_frame_rate.num > 0) {
+            samples = int64_t(duration * av_q2d(stream->avg_frame_rate));
+        } else if (samples <= 0 && stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && stream->codecpar->sample_rate > 0) {
+            int frameSize = stream->codecpar->frame_size > 0 ? stream->codecpar->frame_size : 1024;
+            samples = int64_t(duration * stream->codecpar->sample_rate / frameSize);
+        }
+        if (stream->disposition & AV_DISPOSITION_ATTACHED_PIC) {
+            samples = 1;
+        }
+        size += 1024 + std::max<int64_t>(samples, 0) * (24 + 20);
+    }
+    return size + size / 4;
+}
+
+// Remux srcFilePath into destFilePath; task (may be null) adds muxer options, progress and trimming.
+// Returns 1 on success, 0 on failure, or remuxIncompatible when a codec needs transcoding instead.
+static int remuxMedia(const char* srcFilePath, const char* destFilePath, const char* outputFormat, const RemuxOptions* options, const RemuxTask* task) {
+    const MediaCallControl* control = options ? options->control : nullptr;
+    CallGuard callGuard = makeCallGuard(control);
+    RemuxMonitor progressMonitor;
+    RemuxSession session;
+    session.monitor = task ? task->monitor : nullptr;
+    session.guard = task && task->guard ? task->guard : &callGuard;
+    if (!session.monitor && control && control->progress) {
+        reportCallProgress(&progressMonitor, control);
+        session.monitor = &progressMonitor;
+    }
+
+    // Open input and output, selecting streams and bitstream filters
+    if (openRemuxInput(&session, srcFilePath, options) < 0) {
+        closeRemuxSession(&session);
+        return 0;
+    }
+    if (task && task->sink) {
+        int bufferSize = options && options->writeBufferSize > 0 ? options->writeBufferSize : defaultRemuxBufferSize;
+        session.outputIO = openSinkIO(task->sink, bufferSize, session.monitor ? &session.monitor->bytesWritten : nullptr);
+        if (!session.outputIO) {
+            closeRemuxSession(&session);
+            return 0;
+        }
+    }
+    int opened = openRemuxOutput(&session, destFilePath, outputFormat, options);
+    if (opened < 0) {
+        closeRemuxSession(&session);
+        return opened == remuxIncompatible ? remuxIncompatible : 0;
+    }
+
+    // For fast start, reserve room for the index ahead of the media data so the muxer can write
+    // moov there directly instead of shifting the whole file afterwards
+    AVDictionary* muxerOptions = nullptr;
+    if (task && task->muxerOptions) {
+        av_dict_copy(&muxerOptions, *task->muxerOptions, 0);
+    }
+    bool seekable = session.outputIO && (session.outputIO->seekable & AVIO_SEEKABLE_NORMAL);
+    bool fastStart = options && options->fastStart && isMovFamily(session.output->oformat) && seekable;
+    if (fastStart) {
+        av_dict_set_int(&muxerOptions, "moov_size", estimateMoovSize(&session), 0);
+    }
+    // A sink that can't seek can't take a moov written after the media; fragment instead
+    if (session.outputIO && !seekable && isMovFamily(session.output->oformat)) {
+        av_dict_set(&muxerOptions, "movflags", "+frag_keyframe+empty_moov+default_base_moof", AV_DICT_APPEND);
+    }
+
+    // Write header, every packet and the trailer
+    enterPhase(MEDIA_PHASE_WRITE);
+    int header = avformat_write_header(session.output, &muxerOptions);
+    av_dict_free(&muxerOptions);
+    if (header < 0) {
+        closeRemuxSession(&session);
+        return 0; // Failed to write header
+    }
+    if (task && (task->trimStart > 0 || task->trimEnd >= 0) && seekRemuxInput(&session, srcFilePath, task->trimStart, task->trimEnd) < 0) {
+        closeRemuxSession(&session);
+        return 0; // Couldn't seek to the start
+    }
+    int copied = copyRemuxPackets(&session);
+    enterPhase(MEDIA_PHASE_WRITE);
+    int trailer = av_write_trailer(session.output);
+    int closed = closeFileIO(&session.outputIO);
+    session.output->pb = nullptr;
+    closeRemuxSession(&session);
+
+    // The mov muxer fails the trailer with EINVAL when moov outgrows the reserved space; I/O errors
+    // (they also fail the close) and cancellation are failures, not a reason to go again
+    bool reservationTooSmall = trailer == AVERROR(EINVAL) && closed >= 0 && !session.guard->stopped();
+    if (fastStart && copied >= 0 && reservationTooSmall && !(task && task->sink)) {
+        // The index outgrew the reservation; redo the remux and let the muxer's rewrite pass move moov.
+        // That pass reopens the file by name, so sinks don't get it.
+        RemuxOptions retryOptions = *options;
+        retryOptions.fastStart = 0;
+        AVDictionary* retryMuxerOptions = nullptr;
+        if (task && task->muxerOptions) {
+            av_dict_copy(&retryMuxerOptions, *task->muxerOptions, 0);
+        }
+        av_dict_set(&retryMuxerOptions, "movflags", av_dict_get(retryMuxerOptions, "movflags", nullptr, 0) ? "+faststart" : "faststart", AV_DICT_APPEND);
+        RemuxTask retryTask = task ? *task : RemuxTask{};
+        retryTask.muxerOptions = &retryMuxerOptions;
+        retryTask.guard = session.guard; // Same deadline as the first attempt
+        int ret = remuxMedia(srcFilePath, destFilePath, outputFormat, &retryOptions, &retryTask);
+        av_dict_free(&retryMuxerOptions);
+        return ret;
+    }
+
+    return copied >= 0 && trailer >= 0 && closed >= 0 ? 1 : 0; // Successful conversion
+}
+
+int trimMedia(const char* srcFilePath, const char* destDirPath, const char* outputFileName, const char* outputFormat, double startTime, double endTime, const RemuxOptions* options) {
+    CallScope scope;
+    if (startTime < 0 || (endTime >= 0 && endTime <= startTime)) {
+        return 0; // Invalid range
+    }
+
+    // Construct output file path
+    char destFilePath[1024];
+    snprintf(destFilePath, sizeof(destFilePath), "%s/%s.%s", destDirPath, outputFileName, outputFormat);
+
+    RemuxTask task;
+    task.trimStart = startTime;
+    task.trimEnd = endTime;
+    return remuxMedia(srcFilePath, destFilePath, outputFormat, options, &task) == 1 ? 1 : 0;
+}
+
+int segmentMedia(const char* srcFilePath, const char* destDirPath, const char* outputFileName, int segmentFormat, double segmentDuration, const RemuxOptions* options) {
+    CallScope scope;
+    char manifestFilePath[1024];
+    char segmentFilePath[1024];
+    char segmentDurationText[32];
+    AVDictionary* muxerOptions = nullptr;
+    const char* outputFormat;
+
+    if (segmentDuration <= 0) {
+        return 0; // Invalid segment duration
+    }
+    snprintf(segmentDurationText, sizeof(segmentDurationText), "%g", segmentDuration);
+
+    // The hls and dash muxers cut on keyframes once a segment reaches the target duration and write
+    // the playlist/manifest as they go, so packets are read and written exactly once
+    if (segmentFormat == MEDIA_SEGMENT_HLS_TS || segmentFormat == MEDIA_SEGMENT_HLS_FMP4) {
+        bool fragmented = segmentFormat == MEDIA_SEGMENT_HLS_FMP4;
+        outputFormat = "hls";
+        snprintf(manifestFilePath, sizeof(manifestFilePath), "%s/%s.m3u8", destDirPath, outputFileName);
+        snprintf(segmentFilePath, sizeof(segmentFilePath), "%s/%s_%%05d.%s", destDirPath, outputFileName, fragmented ? "m4s" : "ts");
+        av_dict_set(&muxerOptions, "hls_time", segmentDurationText, 0);
+        av_dict_set(&muxerOptions, "hls_playlist_type", "vod", 0);
+        av_dict_set(&muxerOptions, "hls_list_size", "0", 0);
+        av_dict_set(&muxerOptions, "hls_segment_filename", segmentFilePath, 0);
+        av_dict_set(&muxerOptions, "hls_segment_type", fragmented ? "fmp4" : "mpegts", 0);
+        if (fragmented) {
+            char initFileName[1024];
+            snprintf(initFileName, sizeof(initFileName), "%s_init.mp4", outputFileName);
+            av_dict_set(&muxerOptions, "hls_fmp4_init_filename", initFileName, 0);
+        }
+    } else if (segmentFormat == MEDIA_SEGMENT_DASH) {
+        outputFormat = "dash";
+        snprintf(manifestFilePath, sizeof(manifestFilePath), "%s/%s.mpd", destDirPath, outputFileName);
+        snprintf(segmentFilePath, sizeof(segmentFilePath), "%s_init_$RepresentationID$.m4s", outputFileName);
+        av_dict_set(&muxerOptions, "init_seg_name", segmentFilePath, 0);
+        snprintf(segmentFilePath, sizeof(segmentFilePath), "%s_chunk_$RepresentationID$_$Number%%05d$.m4s", outputFileName);
+        av_dict_set(&muxerOptions, "media_seg_name", segmentFilePath, 0);
+        av_dict_set(&muxerOptions, "seg_duration", segmentDurationText, 0);
+        av_dict_set(&muxerOptions, "use_template", "1", 0);
+        av_dict_set(&muxerOptions, "use_timeline", "1", 0);
+    } else {
+        return 0; // Unknown segment format
+    }
+
+    RemuxTask task;
+    task.muxerOptions = &muxerOptions;
+    int ret = remuxMedia(srcFilePath, manifestFilePath, outputFormat, options, &task);
+    av_dict_free(&muxerOptions);
+    return ret == 1 ? 1 : 0;
+}
+
+// Pick a container (muxer name and file extension) that holds an audio codec as is
+static void audioContainerFor(enum AVCodecID codecId, const char** muxer, const char** extension) {
+    switch (codecId) {
+        case AV_CODEC_ID_AAC:
+        case AV_CODEC_ID_ALAC: *muxer = "ipod"; *extension = "m4a"; break;
+        case AV_CODEC_ID_MP3: *muxer = "mp3"; *extension = "mp3"; break;
+        case AV_CODEC_ID_OPUS: *muxer = "opus"; *extension = "opus"; break;
+        case AV_CODEC_ID_VORBIS: *muxer = "ogg"; *extension = "ogg"; break;
+        case AV_CODEC_ID_FLAC: *muxer = "flac"; *extension = "flac"; break;
+        case AV_CODEC_ID_AC3: *muxer = "ac3"; *extension = "ac3"; break;
+        case AV_CODEC_ID_EAC3: *muxer = "eac3"; *extension = "eac3"; break;
+        default: *muxer = "matroska"; *extension = "mka"; break;
+    }
+}
+
+int extractAudio(const char* srcFilePath, const char* destDirPath, const char* outputFileName, const char* outputFormat) {
+    CallScope scope;
+
+    // Open and probe the input once; the audio stream and its codec come from that same session
+    RemuxOptions options{};
+    RemuxSession session;
+    if (openRemuxInput(&session, srcFilePath, &options) < 0) {
+        closeRemuxSession(&session);
+        return 0; // Couldn't open file
+    }
+    int audioStreamIndex = av_find_best_stream(session.input, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    if (audioStreamIndex < 0) {
+        closeRemuxSession(&session);
+        return 0; // Didn't find an audio stream
+    }
+    enum AVCodecID codecId = session.input->streams[audioStreamIndex]->codecpar->codec_id;
+
+    // Without a format, use the natural container for the codec; m4a and mka are accepted as aliases
+    const char* muxer = outputFormat;
+    const char* extension = outputFormat;
+    if (!outputFormat || !*outputFormat) {
+        audioContainerFor(codecId, &muxer, &extension);
+    } else if (strcmp(outputFormat, "m4a") == 0) {
+        muxer = "ipod";
+    } else if (strcmp(outputFormat, "mka") == 0) {
+        muxer = "matroska";
+    }
+
+    // Construct output file path
+    char destFilePath[1024];
+    snprintf(destFilePath, sizeof(destFilePath), "%s/%s.%s", destDirPath, outputFileName, extension);
+
+    // Copy only the audio stream; every other stream is discarded in the demuxer and never read
+    options.streamIndices = &audioStreamIndex;
+    options.numStreamIndices = 1;
+    if (openRemuxOutput(&session, destFilePath, muxer, &options) < 0) {
+        closeRemuxSession(&session);
+        return 0;
+    }
+    enterPhase(MEDIA_PHASE_WRITE);
+    if (avformat_write_header(session.output, nullptr) < 0) {
+        closeRemuxSession(&session);
+        return 0; // Failed to write header
+    }
+    int copied = copyRemuxPackets(&session);
+    enterPhase(MEDIA_PHASE_WRITE);
+    int trailer = av_write_trailer(session.output);
+    int closed = closeFileIO(&session.outputIO);
+    session.output->pb = nullptr;
+    closeRemuxSession(&session);
+    return copied >= 0 && trailer >= 0 && closed >= 0 ? 1 : 0;
+}
+
+// Stream parameters that have to match for packets of one input to continue another's stream
+static bool concatCompatible(const AVCodecParameters* a, const AVCodecParameters* b) {
+    if (a->codec_type != b->codec_type || a->codec_id != b->codec_id || a->extradata_size != b->extradata_size ||
+        (a->extradata_size > 0 && memcmp(a->extradata, b->extradata, a->extradata_size) != 0)) {
+        return false;
+    }
+    if (a->codec_type == AVMEDIA_TYPE_VIDEO) {
+        return a->width == b->width && a->height == b->height && a->format == b->format;
+    }
+    if (a->codec_type == AVMEDIA_TYPE_AUDIO) {
+        return a->sample_rate == b->sample_rate && a->ch_layout.nb_channels == b->ch_layout.nb_channels && a->format == b->format;
+    }
+    return true;
+}
+
+// An input opened and probed by openConcatInputs, held until the copy reaches it
+struct ConcatInput {
+    AVFormatContext* input = nullptr;
+    AVIOContext* inputIO = nullptr;
+};
+
+static void closeConcatInputs(std::vector<ConcatInput>* inputs) {
+    for (ConcatInput& input : *inputs) {
+        closeInput(&input.input);
+        closeFileIO(&input.inputIO);
+    }
+    inputs->clear();
+}
+
+// Open and probe every input once, before writing anything, and check each has the first input's
+// audio and video streams at the same indices with matching parameters. The inputs stay open for
+// the copy, so none is probed twice.
+static bool openConcatInputs(const char** srcFilePaths, int numInputs, const RemuxOptions* options, std::vector<ConcatInput>* inputs) {
+    std::vector<unsigned int> referenceIndices;
+    for (int i = 0; i < numInputs; ++i) {
+        RemuxSession probe;
+        if (openRemuxInput(&probe, srcFilePaths[i], options) < 0) {
+            closeRemuxSession(&probe);
+            return false; // Couldn't open file or find stream information
+        }
+        inputs->push_back(ConcatInput{probe.input, probe.inputIO});
+
+        AVFormatContext* formatContext = probe.input;
+        const AVFormatContext* first = inputs->front().input;
+        size_t selected = 0;
+        for (unsigned int j = 0; j < formatContext->nb_streams; ++j) {
+            const AVCodecParameters* codecParameters = formatContext->streams[j]->codecpar;
+            if (codecParameters->codec_type != AVMEDIA_TYPE_VIDEO && codecParameters->codec_type != AVMEDIA_TYPE_AUDIO) {
+                continue;
+            }
+            if (i == 0) {
+                referenceIndices.push_back(j);
+            } else if (selected >= referenceIndices.size() || referenceIndices[selected] != j ||
+                       !concatCompatible(first->streams[j]->codecpar, codecParameters)) {
+                return false;
+            }
+            ++selected;
+        }
+        if (selected != referenceIndices.size()) {
+            return false;
+        }
+    }
+    return numInputs > 0;
+}
+
+// Re-create a stream's bitstream filter for the next input: the filter was set up with the previous
+// input's time base, which the next one need not share (e.g. 1/90000 vs 1/12800 in MP4)
+static int resetRemuxFilter(AVBSFContext** filter, const AVStream* stream) {
+    const AVBitStreamFilter* type = (*filter)->filter;
+    av_bsf_free(filter);
+    if (av_bsf_alloc(type, filter) < 0 || avcodec_parameters_copy((*filter)->par_in, stream->codecpar) < 0) {
+        return -1;
+    }
+    (*filter)->time_base_in = stream->time_base;
+    return av_bsf_init(*filter);
+}
+
+int concatMedia(const char** srcFilePaths, int numInputs, const char* destDirPath, const char* outputFileName, const char* outputFormat) {
+    CallScope scope;
+    RemuxOptions options{};
+    options.streamTypes = MEDIA_STREAM_VIDEO | MEDIA_STREAM_AUDIO;
+    std::vector<ConcatInput> inputs;
+    if (!srcFilePaths || numInputs <= 0 || !openConcatInputs(srcFilePaths, numInputs, &options, &inputs)) {
+        closeConcatInputs(&inputs);
+        return 0; // Missing or mismatched inputs
+    }
+
+    // Construct output file path
+    char destFilePath[1024];
+    snprintf(destFilePath, sizeof(destFilePath), "%s/%s.%s", destDirPath, outputFileName, outputFormat);
+
+    // The first input sets up the output streams and bitstream filters for all of them
+    RemuxSession session;
+    session.concatenating = true;
+    session.input = inputs[0].input;
+    session.inputIO = inputs[0].inputIO;
+    inputs[0] = ConcatInput{};
+    if (openRemuxOutput(&session, destFilePath, outputFormat, &options) < 0 ||
+        avformat_write_header(session.output, nullptr) < 0) {
+        closeRemuxSession(&session);
+        closeConcatInputs(&inputs);
+        return 0;
+    }
+
+    int copied = 0;
+    for (int i = 0; i < numInputs && copied >= 0; ++i) {
+        if (i > 0) {
+            // Swap in the next input; stream indices match, so the mapping carries over
+            closeInput(&session.input);
+            closeFileIO(&session.inputIO);
+            session.input = inputs[i].input;
+            session.inputIO = inputs[i].inputIO;
+            inputs[i] = ConcatInput{};
+            session.streamMap.resize(session.input->nb_streams, -1);
+            session.filters.resize(session.input->nb_streams, nullptr);
+            for (unsigned int j = 0; j < session.input->nb_streams; ++j) {
+                if (session.streamMap[j] < 0) {
+                    session.input->streams[j]->discard = AVDISCARD_ALL;
+                } else if (session.filters[j] && resetRemuxFilter(&session.filters[j], session.input->streams[j]) < 0) {
+                    copied = -1;
+                }
+            }
+            if (copied < 0) {
+                break;
+            }
+            session.timestampOffset = AV_NOPTS_VALUE;
+        }
+        copied = copyRemuxPackets(&session);
+    }
+
+    enterPhase(MEDIA_PHASE_WRITE);
+    int trailer = av_write_trailer(session.output);
+    int closed = closeFileIO(&session.outputIO);
+    session.output->pb = nullptr;
+    closeRemuxSession(&session);
+    closeConcatInputs(&inputs);
+    return copied >= 0 && trailer >= 0 && closed >= 0 ? 1 : 0;
+}
+
+// Duration from the packets themselves rather than the container's estimate: a demux-only scan of
+// the first audio stream (the first video stream when there is none) through large sequential
+// reads. Audio packet durations add up to the exact sample count; if a packet has no duration,
+// the span of timestamps is used instead.
+double getMediaDurationExact(const char* filePath) {
+    CallScope scope;
+    RemuxSession session;
+    if (openRemuxInput(&session, filePath, nullptr) < 0) {
+        closeRemuxSession(&session);
+        return 0; // Couldn't open file
+    }
+    AVFormatContext* input = session.input;
+    int streamIndex = -1;
+    for (enum AVMediaType type : {AVMEDIA_TYPE_AUDIO, AVMEDIA_TYPE_VIDEO}) {
+        for (unsigned int i = 0; i < input->nb_streams && streamIndex == -1; ++i) {
+            AVStream* stream = input->streams[i];
+            if (stream->codecpar->codec_type == type && !(stream->disposition & AV_DISPOSITION_ATTACHED_PIC)) {
+                streamIndex = int(i);
+            }
+        }
+    }
+    if (streamIndex == -1) {
+        closeRemuxSession(&session);
+        return 0; // No audio or video stream
+    }
+    for (unsigned int i = 0; i < input->nb_streams; ++i) {
+        if (int(i) != streamIndex) {
+            input->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    AVPacket packet;
+    int64_t total = 0;
+    int64_t first = INT64_MAX;
+    int64_t last = INT64_MIN;
+    bool allTimed = true;
+    enterPhase(MEDIA_PHASE_COPY);
+    while (av_read_frame(input, &packet) >= 0) {
+        if (packet.stream_index == streamIndex) {
+            int64_t pts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+            if (pts != AV_NOPTS_VALUE) {
+                first = std::min(first, pts);
+                last = std::max(last, pts + packet.duration);
+            }
+            allTimed = allTimed && packet.duration > 0;
+            total += packet.duration;
+        }
+        av_packet_unref(&packet);
+    }
+    AVRational timeBase = input->streams[streamIndex]->time_base;
+    closeRemuxSession(&session);
+
+    if (!allTimed) {
+        total = last > first ? last - first : 0;
+    }
+    return double(total) * av_q2d(timeBase);
+}
+
+// A fixed-capacity blocking queue between pipeline stages. close() wakes everyone up: pushes fail
+// from then on and pops return whatever is left, then false.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t maxItems) : capacity(maxItems) {}
+
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this]() { return closed || items.size() < capacity; });
+        if (closed) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this]() { return closed || !items.empty(); });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed = false;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+};
+
+// Encoder capability lists, through whichever API this libavcodec provides
+static const enum AVPixelFormat* encoderPixelFormats(const AVCodec* codec) {
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(61, 13, 100)
+    const void* formats = nullptr;
+    return avcodec_get_supported_config(nullptr, codec, AV_CODEC_CONFIG_PIX_FORMAT, 0, &formats, nullptr) >= 0 ? static_cast<const enum AVPixelFormat*>(formats) : nullptr;
+#else
+    return codec->pix_fmts;
+#endif
+}
+
+static const enum AVSampleFormat* encoderSampleFormats(const AVCodec* codec) {
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(61, 13, 100)
+    const void* formats = nullptr;
+    return avcodec_get_supported_config(nullptr, codec, AV_CODEC_CONFIG_SAMPLE_FORMAT, 0, &formats, nullptr) >= 0 ? static_cast<const enum AVSampleFormat*>(formats) : nullptr;
+#else
+    return codec->sample_fmts;
+#endif
+}
+
+static const int* encoderSampleRates(const AVCodec* codec) {
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(61, 13, 100)
+    const void* rates = nullptr;
+    return avcodec_get_supported_config(nullptr, codec, AV_CODEC_CONFIG_SAMPLE_RATE, 0, &rates, nullptr) >= 0 ? static_cast<const int*>(rates) : nullptr;
+#else
+    return codec->supported_samplerates;
+#endif
+}
+
+// Find an encoder for the output: the requested one, else the container's default, else the first
+// encoder from a list of ones commonly present in stock builds that the container accepts
+static const AVCodec* findTranscodeEncoder(const char* name, enum AVMediaType type, const AVOutputFormat* outputFormat) {
+    if (name && *name) {
+        return avcodec_find_encoder_by_name(name);
+    }
+    enum AVCodecID defaultCodec = type == AVMEDIA_TYPE_VIDEO ? outputFormat->video_codec : outputFormat->audio_codec;
+    const AVCodec* encoder = defaultCodec != AV_CODEC_ID_NONE ? avcodec_find_encoder(defaultCodec) : nullptr;
+    if (encoder) {
+        return encoder;
+    }
+    static const char* const videoEncoders[] = {"libx264", "libvpx-vp9", "libvpx", "libaom-av1", "mpeg4", "mjpeg", nullptr};
+    static const char* const audioEncoders[] = {"aac", "libopus", "libvorbis", "libmp3lame", "flac", "mp2", "pcm_s16le", nullptr};
+    for (const char* const* candidate = type == AVMEDIA_TYPE_VIDEO ? videoEncoders : audioEncoders; *candidate; ++candidate) {
+        encoder = avcodec_find_encoder_by_name(*candidate);
+        if (encoder && avformat_query_codec(outputFormat, encoder->id, FF_COMPLIANCE_NORMAL) == 1) {
+            return encoder;
+        }
+    }
+    return nullptr;
+}
+
+static AVCodecContext* openTranscodeDecoder(const AVStream* stream) {
+    const AVCodec* codec = avcodec_find_decoder(stream->codecpar->codec_id);
+    AVCodecContext* decoder = codec ? avcodec_alloc_context3(codec) : nullptr;
+    if (!decoder) {
+        return nullptr;
+    }
+    decoder->thread_count = 0; // Let libavcodec pick a thread count for the core count
+    if (avcodec_parameters_to_context(decoder, stream->codecpar) < 0 || avcodec_open2(decoder, codec, nullptr) < 0) {
+        avcodec_free_context(&decoder);
+        return nullptr;
+    }
+    decoder->pkt_timebase = stream->time_base;
+    return decoder;
+}
+
+// One re-encoded stream. Video runs decode -> scale -> encode across three threads; audio is cheap
+// enough to decode, resample and encode inline on the demuxing thread.
+struct TranscodeStream {
+    int inputIndex = -1;
+    int outputIndex = -1;
+    AVCodecContext* decoder = nullptr;
+    AVCodecContext* encoder = nullptr;
+    // Video
+    struct SwsContext* scaler = nullptr;
+    int64_t lastPts = AV_NOPTS_VALUE;
+    // Audio
+    SwrContext* resampler = nullptr;
+    AVAudioFifo* fifo = nullptr;
+    int frameSize = 0;
+    int64_t nextPts = AV_NOPTS_VALUE;
+};
+
+struct TranscodeSession {
+    RemuxSession remux;                 // Input, output and the stream-copied streams
+    std::vector<TranscodeStream> streams;
+    TranscodeStream* video = nullptr;   // The one video stream that goes through the threaded pipeline
+    std::mutex muxerMutex;              // The encode thread and the demuxing thread both write packets
+    std::atomic<bool> failed{false};
+    MediaCallStats scaleStats{};        // What the scale and encode threads spent, merged after they join
+    MediaCallStats encodeStats{};
+};
+
+static void closeTranscodeSession(TranscodeSession* session) {
+    for (TranscodeStream& stream : session->streams) {
+        avcodec_free_context(&stream.decoder);
+        avcodec_free_context(&stream.encoder);
+        sws_freeContext(stream.scaler);
+        swr_free(&stream.resampler);
+        if (stream.fifo) {
+            av_audio_fifo_free(stream.fifo);
+        }
+    }
+    session->streams.clear();
+    closeRemuxSession(&session->remux);
+}
+
+// Send a frame (nullptr to flush) to an encoder and write every packet it produces
+static int encodeTranscodeFrame(TranscodeSession* session, TranscodeStream* stream, AVFrame* frame) {
+    PhaseScope encoding(MEDIA_PHASE_ENCODE);
+    int ret = avcodec_send_frame(stream->encoder, frame);
+    if (ret < 0) {
+        return ret;
+    }
+    AVPacket* packet = av_packet_alloc();
+    if (!packet) {
+        return AVERROR(ENOMEM);
+    }
+    AVStream* outputStream = session->remux.output->streams[stream->outputIndex];
+    while ((ret = avcodec_receive_packet(stream->encoder, packet)) == 0) {
+        av_packet_rescale_ts(packet, stream->encoder->time_base, outputStream->time_base);
+        packet->stream_index = stream->outputIndex;
+        PhaseScope writing(MEDIA_PHASE_WRITE);
+        std::lock_guard<std::mutex> lock(session->muxerMutex);
+        ret = av_interleaved_write_frame(session->remux.output, packet);
+        if (ret < 0) {
+            break;
+        }
+    }
+    av_packet_free(&packet);
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+static int setupVideoTranscode(TranscodeSession* session, TranscodeStream* stream, const TranscodeOptions* options) {
+    AVFormatContext* input = session->remux.input;
+    AVFormatContext* output = session->remux.output;
+    AVStream* inputStream = input->streams[stream->inputIndex];
+
+    stream->decoder = openTranscodeDecoder(inputStream);
+    const AVCodec* encoder = findTranscodeEncoder(options ? options->videoEncoder : nullptr, AVMEDIA_TYPE_VIDEO, output->oformat);
+    if (!stream->decoder || !encoder || !(stream->encoder = avcodec_alloc_context3(encoder))) {
+        return -1; // No decoder or encoder
+    }
+
+    // Output size: as requested (keeping the aspect ratio when only one side is given), else the
+    // source size; even dimensions keep 4:2:0 encoders happy
+    int width = options && options->width > 0 ? options->width : 0;
+    int height = options && options->height > 0 ? options->height : 0;
+    if (width > 0 && height == 0) {
+        height = int(av_rescale(width, stream->decoder->height, stream->decoder->width));
+    } else if (height > 0 && width == 0) {
+        width = int(av_rescale(height, stream->decoder->width, stream->decoder->height));
+    } else if (width == 0 && height == 0) {
+        width = stream->decoder->width;
+        height = stream->decoder->height;
+    }
+
+    // Prefer plain 4:2:0, then the source format, then whatever the encoder lists first
+    enum AVPixelFormat pixelFormat = AV_PIX_FMT_YUV420P;
+    const enum AVPixelFormat* formats = encoderPixelFormats(encoder);
+    if (formats) {
+        bool hasYuv420 = false;
+        bool hasSource = false;
+        for (const enum AVPixelFormat* format = formats; *format != AV_PIX_FMT_NONE; ++format) {
+            hasYuv420 = hasYuv420 || *format == AV_PIX_FMT_YUV420P;
+            hasSource = hasSource || *format == stream->decoder->pix_fmt;
+        }
+        pixelFormat = hasYuv420 ? AV_PIX_FMT_YUV420P : hasSource ? stream->decoder->pix_fmt : formats[0];
+    }
+
+    AVRational frameRate = av_guess_frame_rate(input, inputStream, nullptr);
+    if (frameRate.num <= 0 || frameRate.den <= 0) {
+        frameRate = AVRational{25, 1};
+    }
+
+    AVCodecContext* context = stream->encoder;
+    context->width = width & ~1;
+    context->height = height & ~1;
+    context->pix_fmt = pixelFormat;
+    context->sample_aspect_ratio = stream->decoder->sample_aspect_ratio;
+    context->framerate = frameRate;
+    context->time_base = av_inv_q(frameRate);
+    context->gop_size = std::max(1, int(av_q2d(frameRate) * 2));
+    context->thread_count = options ? options->encoderThreads : 0;
+    context->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    // Without a target, scale the source bitrate by the change in area, or budget ~0.1 bit per pixel
+    int64_t bitRate = options ? options->videoBitRate : 0;
+    if (bitRate <= 0 && inputStream->codecpar->bit_rate > 0 && stream->decoder->width > 0 && stream->decoder->height > 0) {
+        bitRate = av_rescale(inputStream->codecpar->bit_rate, int64_t(context->width) * context->height, int64_t(stream->decoder->width) * stream->decoder->height);
+    }
+    if (bitRate <= 0) {
+        bitRate = int64_t(0.1 * context->width * context->height * av_q2d(frameRate));
+    }
+    context->bit_rate = bitRate;
+    if (output->oformat->flags & AVFMT_GLOBALHEADER) {
+        context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    if (avcodec_open2(context, encoder, nullptr) < 0) {
+        return -1; // Could not open encoder
+    }
+
+    AVStream* outputStream = avformat_new_stream(output, nullptr);
+    if (!outputStream || avcodec_parameters_from_context(outputStream->codecpar, context) < 0) {
+        return -1; // Failed to create output stream
+    }
+    outputStream->time_base = context->time_base;
+    outputStream->avg_frame_rate = frameRate;
+    outputStream->disposition = inputStream->disposition;
+    stream->outputIndex = outputStream->index;
+    return 0;
+}
+
+static int setupAudioTranscode(TranscodeSession* session, TranscodeStream* stream, const TranscodeOptions* options) {
+    AVFormatContext* output = session->remux.output;
+    AVStream* inputStream = session->remux.input->streams[stream->inputIndex];
+
+    stream->decoder = openTranscodeDecoder(inputStream);
+    const AVCodec* encoder = findTranscodeEncoder(options ? options->audioEncoder : nullptr, AVMEDIA_TYPE_AUDIO, output->oformat);
+    if (!stream->decoder || !encoder || !(stream->encoder = avcodec_alloc_context3(encoder))) {
+        return -1; // No decoder or encoder
+    }
+    AVCodecContext* context = stream->encoder;
+
+    // Keep the source rate when the encoder takes it, otherwise 48 kHz or its first supported rate
+    int sampleRate = stream->decoder->sample_rate;
+    const int* rates = encoderSampleRates(encoder);
+    if (rates) {
+        bool supported = false;
+        bool has48k = false;
+        for (const int* rate = rates; *rate; ++rate) {
+            supported = supported || *rate == sampleRate;
+            has48k = has48k || *rate == 48000;
+        }
+        if (!supported) {
+            sampleRate = has48k ? 48000 : rates[0];
+        }
+    }
+    const enum AVSampleFormat* sampleFormats = encoderSampleFormats(encoder);
+    context->sample_fmt = sampleFormats ? sampleFormats[0] : AV_SAMPLE_FMT_FLTP;
+    context->sample_rate = sampleRate;
+    if (stream->decoder->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC) {
+        av_channel_layout_default(&context->ch_layout, stream->decoder->ch_layout.nb_channels);
+    } else if (av_channel_layout_copy(&context->ch_layout, &stream->decoder->ch_layout) < 0) {
+        return -1;
+    }
+    context->time_base = AVRational{1, sampleRate};
+    context->bit_rate = options && options->audioBitRate > 0 ? options->audioBitRate : 128000;
+    context->thread_count = options ? options->encoderThreads : 0;
+    if (output->oformat->flags & AVFMT_GLOBALHEADER) {
+        context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    if (avcodec_open2(context, encoder, nullptr) < 0) {
+        return -1; // Could not open encoder
+    }
+
+    // Convert to the encoder's format/rate/layout, and re-chunk to its frame size through a FIFO
+    if (swr_alloc_set_opts2(&stream->resampler, &context->ch_layout, context->sample_fmt, context->sample_rate,
+                            &stream->decoder->ch_layout, stream->decoder->sample_fmt, stream->decoder->sample_rate, 0, nullptr) < 0 ||
+        swr_init(stream->resampler) < 0) {
+        return -1; // Could not set up resampling
+    }
+    stream->frameSize = context->frame_size > 0 && !(encoder->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE) ? context->frame_size : 1024;
+    stream->fifo = av_audio_fifo_alloc(context->sample_fmt, context->ch_layout.nb_channels, stream->frameSize * 2);
+    if (!stream->fifo) {
+        return -1;
+    }
+
+    AVStream* outputStream = avformat_new_stream(output, nullptr);
+    if (!outputStream || avcodec_parameters_from_context(outputStream->codecpar, context) < 0) {
+        return -1; // Failed to create output stream
+    }
+    outputStream->time_base = context->time_base;
+    outputStream->disposition = inputStream->disposition;
+    stream->outputIndex = outputStream->index;
+    return 0;
+}
+
+// Encode whole encoder-sized frames from the FIFO; at the end (flush) also the remainder
+static int drainAudioFifo(TranscodeSession* session, TranscodeStream* stream, bool flush) {
+    while (av_audio_fifo_size(stream->fifo) >= stream->frameSize || (flush && av_audio_fifo_size(stream->fifo) > 0)) {
+        AVFrame* frame = av_frame_alloc();
+        if (!frame) {
+            return AVERROR(ENOMEM);
+        }
+        frame->nb_samples = std::min(stream->frameSize, av_audio_fifo_size(stream->fifo));
+        frame->format = stream->encoder->sample_fmt;
+        frame->sample_rate = stream->encoder->sample_rate;
+        int ret = av_channel_layout_copy(&frame->ch_layout, &stream->encoder->ch_layout);
+        if (ret >= 0) {
+            ret = av_frame_get_buffer(frame, 0);
+        }
+        if (ret >= 0) {
+            av_audio_fifo_read(stream->fifo, (void**)frame->data, frame->nb_samples);
+            frame->pts = stream->nextPts;
+            stream->nextPts += frame->nb_samples;
+            ret = encodeTranscodeFrame(session, stream, frame);
+        }
+        av_frame_free(&frame);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+// Resample a decoded audio frame (nullptr flushes the resampler) into the FIFO and encode what's ready
+static int transcodeAudioFrame(TranscodeSession* session, TranscodeStream* stream, const AVFrame* frame) {
+    if (frame && stream->nextPts == AV_NOPTS_VALUE) {
+        int64_t pts = frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : 0;
+        AVRational inputTimeBase = session->remux.input->streams[stream->inputIndex]->time_base;
+        stream->nextPts = av_rescale_q(pts, inputTimeBase, stream->encoder->time_base);
+    }
+    int outputSamples = swr_get_out_samples(stream->resampler, frame ? frame->nb_samples : 0);
+    if (outputSamples > 0) {
+        uint8_t** converted = nullptr;
+        int channels = stream->encoder->ch_layout.nb_channels;
+        converted = static_cast<uint8_t**>(av_mallocz(sizeof(uint8_t*) * size_t(channels)));
+        if (!converted || av_samples_alloc(converted, nullptr, channels, outputSamples, stream->encoder->sample_fmt, 0) < 0) {
+            av_free(converted);
+            return AVERROR(ENOMEM);
+        }
+        PhaseScope resampling(MEDIA_PHASE_SCALE);
+        int samples = swr_convert(stream->resampler, converted, outputSamples, frame ? (const uint8_t**)frame->extended_data : nullptr, frame ? frame->nb_samples : 0);
+        if (samples > 0) {
+            av_audio_fifo_write(stream->fifo, (void**)converted, samples);
+        }
+        av_freep(&converted[0]);
+        av_free(converted);
+        if (samples < 0) {
+            return samples;
+        }
+    }
+    if (stream->nextPts == AV_NOPTS_VALUE) {
+        stream->nextPts = 0;
+    }
+    return drainAudioFifo(session, stream, frame == nullptr);
+}
+
+// Pipeline stage 2: scale decoded frames into the encoder's size and pixel format
+static void scaleTranscodeFrames(TranscodeSession* session, BoundedQueue<AVFrame*>* decoded, BoundedQueue<AVFrame*>* scaled) {
+    TranscodeStream* stream = session->video;
+    AVRational inputTimeBase = session->remux.input->streams[stream->inputIndex]->time_base;
+    StageScope stage(&session->scaleStats);
+    AVFrame* frame = nullptr;
+    while (decoded->pop(frame)) {
+        enterPhase(MEDIA_PHASE_SCALE);
+        AVFrame* output = av_frame_alloc();
+        stream->scaler = sws_getCachedContext(stream->scaler, frame->width, frame->height, (enum AVPixelFormat)frame->format,
+                                              stream->encoder->width, stream->encoder->height, stream->encoder->pix_fmt, SWS_BICUBIC, nullptr, nullptr, nullptr);
+        if (output) {
+            output->format = stream->encoder->pix_fmt;
+            output->width = stream->encoder->width;
+            output->height = stream->encoder->height;
+        }
+        if (!output || !stream->scaler || av_frame_get_buffer(output, 0) < 0) {
+            av_frame_free(&output);
+            av_frame_free(&frame);
+            session->failed = true;
+            break;
+        }
+        sws_scale(stream->scaler, (uint8_t const* const*)frame->data, frame->linesize, 0, frame->height, output->data, output->linesize);
+
+        // Encoder PTS are in frame-rate ticks; keep them strictly increasing for VFR input
+        int64_t pts = frame->best_effort_timestamp != AV_NOPTS_VALUE ? av_rescale_q(frame->best_effort_timestamp, inputTimeBase, stream->encoder->time_base) : AV_NOPTS_VALUE;
+        if (pts == AV_NOPTS_VALUE || (stream->lastPts != AV_NOPTS_VALUE && pts <= stream->lastPts)) {
+            pts = stream->lastPts != AV_NOPTS_VALUE ? stream->lastPts + 1 : 0;
+        }
+        stream->lastPts = pts;
+        output->pts = pts;
+        av_frame_free(&frame);
+
+        enterPhase(MEDIA_PHASE_NONE); // Waiting on the encoder isn't scaling
+        if (!scaled->push(output)) {
+            av_frame_free(&output);
+            break;
+        }
+    }
+    scaled->close();
+    if (session->failed) {
+        decoded->close();
+    }
+}
+
+// Pipeline stage 3: encode scaled frames and write the packets, then flush the encoder
+static void encodeTranscodeFrames(TranscodeSession* session, BoundedQueue<AVFrame*>* scaled, BoundedQueue<AVFrame*>* decoded) {
+    StageScope stage(&session->encodeStats);
+    AVFrame* frame = nullptr;
+    while (scaled->pop(frame)) {
+        int ret = encodeTranscodeFrame(session, session->video, frame);
+        av_frame_free(&frame);
+        if (ret < 0) {
+            session->failed = true;
+            scaled->close();
+            decoded->close();
+            return;
+        }
+    }
+    if (!session->failed && encodeTranscodeFrame(session, session->video, nullptr) < 0) {
+        session->failed = true;
+    }
+}
+
+// Decode a packet (nullptr flushes) and pass the frames on: video into the pipeline, audio inline
+static int decodeTranscodePacket(TranscodeSession* session, TranscodeStream* stream, const AVPacket* packet, BoundedQueue<AVFrame*>* decoded) {
+    PhaseScope decoding(MEDIA_PHASE_DECODE);
+    int ret = avcodec_send_packet(stream->decoder, packet);
+    if (ret < 0 && packet) {
+        return 0; // Skip undecodable packets
+    }
+    AVFrame* frame = av_frame_alloc();
+    if (!frame) {
+        return AVERROR(ENOMEM);
+    }
+    while ((ret = avcodec_receive_frame(stream->decoder, frame)) == 0) {
+        countDecodedFrame();
+        if (stream == session->video) {
+            AVFrame* queued = av_frame_alloc();
+            if (!queued) {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            av_frame_move_ref(queued, frame);
+            PhaseScope waiting(MEDIA_PHASE_NONE); // Back-pressure from the scaler isn't decoding
+            if (!decoded->push(queued)) {
+                av_frame_free(&queued);
+                ret = AVERROR_EXIT; // A later stage gave up
+                break;
+            }
+        } else {
+            ret = transcodeAudioFrame(session, stream, frame);
+            av_frame_unref(frame);
+            if (ret < 0) {
+                break;
+            }
+        }
+    }
+    av_frame_free(&frame);
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+// Re-encode a stream unless the caller allows copying, the container takes its codec as is and
+// nothing was asked of it that only an encoder can do
+static bool needsTranscode(const TranscodeOptions* options, enum AVMediaType type, bool compatible) {
+    if (!options || !options->copyCompatibleStreams || !compatible) {
+        return true;
+    }
+    if (type == AVMEDIA_TYPE_VIDEO) {
+        return options->width > 0 || options->height > 0 || options->videoEncoder || options->videoBitRate > 0;
+    }
+    return options->audioEncoder || options->audioBitRate > 0;
+}
+
+// Transcode srcFilePath into destFilePath (1 on success, 0 on failure), with progress through monitor.
+// callGuard, when given, replaces one made from the options' control, e.g. to keep a remux attempt's deadline.
+static int transcodeMediaFile(const char* srcFilePath, const char* destFilePath, const char* outputFormat, const TranscodeOptions* options, RemuxMonitor* monitor, const CallGuard* callGuard) {
+    const MediaCallControl* control = options ? options->control : nullptr;
+    CallGuard ownGuard = makeCallGuard(control);
+    const CallGuard* guard = callGuard ? callGuard : &ownGuard;
+    RemuxMonitor progressMonitor;
+    if (!monitor && control && control->progress) {
+        reportCallProgress(&progressMonitor, control);
+        monitor = &progressMonitor;
+    }
+    TranscodeSession session;
+    session.remux.monitor = monitor;
+    session.remux.guard = guard;
+    size_t queueDepth = options && options->queueDepth > 0 ? size_t(options->queueDepth) : 8;
+    BoundedQueue<AVFrame*> decoded(queueDepth);
+    BoundedQueue<AVFrame*> scaled(queueDepth);
+
+    // Open input and output
+    if (openRemuxInput(&session.remux, srcFilePath, nullptr) < 0) {
+        closeTranscodeSession(&session);
+        return 0;
+    }
+    AVFormatContext* input = session.remux.input;
+    avformat_alloc_output_context2(&session.remux.output, nullptr, outputFormat, destFilePath);
+    if (!session.remux.output) {
+        closeTranscodeSession(&session);
+        return 0; // Couldn't create output context
+    }
+    AVFormatContext* output = session.remux.output;
+
+    // Decide per stream: re-encode audio/video (only the first video stream), copy subtitles the
+    // container supports, drop everything else
+    enterPhase(MEDIA_PHASE_CODEC_OPEN);
+    session.remux.streamMap.assign(input->nb_streams, -1);
+    session.remux.filters.assign(input->nb_streams, nullptr);
+    session.streams.reserve(input->nb_streams);
+    std::vector<TranscodeStream*> byInput(input->nb_streams, nullptr);
+    for (unsigned int i = 0; i < input->nb_streams; ++i) {
+        AVStream* inputStream = input->streams[i];
+        enum AVMediaType type = inputStream->codecpar->codec_type;
+        bool compatible = avformat_query_codec(output->oformat, inputStream->codecpar->codec_id, FF_COMPLIANCE_NORMAL) != 0;
+        bool media = type == AVMEDIA_TYPE_AUDIO || (type == AVMEDIA_TYPE_VIDEO && !(inputStream->disposition & AV_DISPOSITION_ATTACHED_PIC));
+        int ret = 0;
+        if (media && needsTranscode(options, type, compatible) && !(type == AVMEDIA_TYPE_VIDEO && session.video)) {
+            session.streams.emplace_back();
+            TranscodeStream* stream = &session.streams.back();
+            stream->inputIndex = int(i);
+            ret = type == AVMEDIA_TYPE_VIDEO ? setupVideoTranscode(&session, stream, options) : setupAudioTranscode(&session, stream, options);
+            if (type == AVMEDIA_TYPE_VIDEO) {
+                session.video = stream;
+            }
+            byInput[i] = stream;
+        } else if ((type == AVMEDIA_TYPE_VIDEO || type == AVMEDIA_TYPE_AUDIO || type == AVMEDIA_TYPE_SUBTITLE) && compatible) {
+            ret = addCopyStream(&session.remux, i, true);
+        } else {
+            inputStream->discard = AVDISCARD_ALL;
+        }
+        if (ret < 0) {
+            closeTranscodeSession(&session);
+            return 0; // Couldn't set up stream
+        }
+    }
+    enterPhase(MEDIA_PHASE_WRITE);
+    if (output->nb_streams == 0 || openRemuxOutputFile(&session.remux, destFilePath, nullptr) < 0 || avformat_write_header(output, nullptr) < 0) {
+        closeTranscodeSession(&session);
+        return 0; // Nothing to write or couldn't start the output
+    }
+
+    // Start the scale and encode stages
+    std::thread scaleThread;
+    std::thread encodeThread;
+    if (session.video) {
+        scaleThread = std::thread(scaleTranscodeFrames, &session, &decoded, &scaled);
+        encodeThread = std::thread(encodeTranscodeFrames, &session, &scaled, &decoded);
+    }
+
+    // Stage 1 on this thread: demux, copy what's copied and decode the rest
+    enterPhase(MEDIA_PHASE_DECODE);
+    AVPacket packet;
+    int ret = 0;
+    while (ret >= 0 && !session.failed && !guard->stopped() && av_read_frame(input, &packet) >= 0) {
+        int index = packet.stream_index;
+        if (monitor) {
+            updateRemuxMonitor(monitor, input->streams[index], &packet);
+        }
+        if (byInput[index]) {
+            ret = decodeTranscodePacket(&session, byInput[index], &packet, &decoded);
+        } else if (session.remux.streamMap[index] >= 0) {
+            PhaseScope copying(MEDIA_PHASE_COPY);
+            std::lock_guard<std::mutex> lock(session.muxerMutex);
+            writeRemuxPacket(&session.remux, &packet);
+        }
+        av_packet_unref(&packet);
+    }
+    if (guard->stopped()) {
+        ret = AVERROR_EXIT; // Cancelled or out of time; skip the flush
+    }
+
+    // Flush decoders (and audio resamplers/FIFOs), then let the pipeline drain
+    for (TranscodeStream& stream : session.streams) {
+        if (ret >= 0 && !session.failed) {
+            ret = decodeTranscodePacket(&session, &stream, nullptr, &decoded);
+        }
+        if (ret >= 0 && !session.failed && &stream != session.video) {
+            ret = transcodeAudioFrame(&session, &stream, nullptr);
+            if (ret >= 0) {
+                ret = encodeTranscodeFrame(&session, &stream, nullptr);
+            }
+        }
+    }
+    decoded.close();
+    if (session.video) {
+        PhaseScope waiting(MEDIA_PHASE_NONE);
+        scaleThread.join();
+        encodeThread.join();
+        mergeCallStats(session.scaleStats);
+        mergeCallStats(session.encodeStats);
+    }
+
+    // Free frames left behind if a stage stopped early
+    AVFrame* leftover = nullptr;
+    while (decoded.pop(leftover)) {
+        av_frame_free(&leftover);
+    }
+    while (scaled.pop(leftover)) {
+        av_frame_free(&leftover);
+    }
+
+    bool ok = ret >= 0 && !session.failed;
+    enterPhase(MEDIA_PHASE_WRITE);
+    int trailer = av_write_trailer(output);
+    int closed = closeFileIO(&session.remux.outputIO);
+    output->pb = nullptr;
+    closeTranscodeSession(&session);
+    return ok && trailer >= 0 && closed >= 0 ? 1 : 0;
+}
+
+int transcodeMedia(const char* srcFilePath, const char* destDirPath, const char* outputFileName, const char* outputFormat, const TranscodeOptions* options) {
+    CallScope scope;
+    // Construct output file path
+    char destFilePath[1024];
+    snprintf(destFilePath, sizeof(destFilePath), "%s/%s.%s", destDirPath, outputFileName, outputFormat);
+    return transcodeMediaFile(srcFilePath, destFilePath, outputFormat, options, nullptr, nullptr);
+}
+
+int convertMediaFormatWithOptions(const char* srcFilePath, const char* destDirPath, const char* outputFileName, const char* outputFormat, const RemuxOptions* options) {
+    CallScope scope;
+    // Construct output file path
+    char destFilePath[1024];
+    snprintf(destFilePath, sizeof(destFilePath), "%s/%s.%s", destDirPath, outputFileName, outputFormat);
+    // One guard for both attempts, so a fallback to transcoding doesn't restart the deadline
+    CallGuard guard = makeCallGuard(options ? options->control : nullptr);
+    RemuxTask task;
+    task.guard = &guard;
+    int ret = remuxMedia(srcFilePath, destFilePath, outputFormat, options, &task);
+    if (ret == remuxIncompatible) {
+        // The container can't hold a codec as is: re-encode just the streams that need it
+        TranscodeOptions fallback{};
+        fallback.copyCompatibleStreams = 1;
+        fallback.control = options ? options->control : nullptr;
+        return transcodeMediaFile(srcFilePath, destFilePath, outputFormat, &fallback, nullptr, &guard);
+    }
+    return ret;
+}
+
+int convertMediaFormat(const char* srcFilePath, const char* destDirPath, const char* outputFileName, const char* outputFormat) {
+    CallScope scope;
+    return convertMediaFormatWithOptions(srcFilePath, destDirPath, outputFileName, outputFormat, nullptr);
+}
+
+// Streaming variants: the output goes to a sink rather than a file, so there is no transcode
+// fallback for codecs the container can't hold
+int convertMediaFormatToCallback(const char* srcFilePath, const char* outputFormat, const RemuxOptions* options, MediaWriteCallback write, MediaSeekCallback seek, void* user) {
+    CallScope scope;
+    if (!write || !outputFormat) {
+        return 0; // Nowhere to write, or no format to write in
+    }
+    RemuxSink sink;
+    sink.write = write;
+    sink.seek = seek;
+    sink.user = user;
+    RemuxTask task;
+    task.sink = &sink;
+    return remuxMedia(srcFilePath, "", outputFormat, options, &task) == 1 ? 1 : 0;
+}
+
+int convertMediaFormatToFd(const char* srcFilePath, int fd, const char* outputFormat, const RemuxOptions* options) {
+    CallScope scope;
+    if (fd < 0 || !outputFormat) {
+        return 0; // Nowhere to write, or no format to write in
+    }
+    RemuxSink sink;
+    sink.fd = fd;
+    RemuxTask task;
+    task.sink = &sink;
+    return remuxMedia(srcFilePath, "", outputFormat, options, &task) == 1 ? 1 : 0;
+}
+
+// Library-wide work-stealing scheduler. Each worker owns a deque: tasks submitted from a worker go
+// on its own deque and it takes the newest first, while idle workers steal the oldest from the
+// others. Other threads' submissions are spread round-robin. Started on first use, with one worker
+// per core unless mediaLibraryInit says otherwise. Tasks may block on I/O, but must not wait on
+// other tasks; pipelines whose stages wait on each other (transcoding) keep their own threads.
+struct TaskQueue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+};
+
+struct TaskScheduler {
+    std::mutex mutex;
+    std::condition_variable wake;
+    int64_t pending = 0; // Queued tasks not yet taken, guarded by mutex
+    std::vector<std::unique_ptr<TaskQueue>> queues;
+    std::vector<int> affinity;
+    int numThreads = 0;
+    bool started = false;
+    std::atomic<unsigned int> nextQueue{0};
+};
+
+static thread_local int currentWorker = -1;
+
+static TaskScheduler& taskScheduler() {
+    // Intentionally leaked so worker threads never outlive it during static destruction
+    static auto* scheduler = new TaskScheduler();
+    return *scheduler;
+}
+
+static bool takeTask(TaskScheduler& scheduler, int worker, std::function<void()>& task) {
+    int numQueues = int(scheduler.queues.size());
+    for (int i = 0; i < numQueues; ++i) {
+        TaskQueue& queue = *scheduler.queues[size_t((worker + i) % numQueues)];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            if (i == 0) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+static void pinWorker(int cpu) {
+#if defined(__linux__)
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#else
+    (void)cpu; // No thread affinity on this platform
+#endif
+}
+
+static void schedulerWorker(int worker) {
+    TaskScheduler& scheduler = taskScheduler();
+    currentWorker = worker;
+    if (!scheduler.affinity.empty()) {
+        pinWorker(scheduler.affinity[size_t(worker) % scheduler.affinity.size()]);
+    }
+    while (true) {
+        std::function<void()> task;
+        if (takeTask(scheduler, worker, task)) {
+            {
+                std::lock_guard<std::mutex> lock(scheduler.mutex);
+                --scheduler.pending;
+            }
+            task();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(scheduler.mutex);
+        scheduler.wake.wait(lock, [&scheduler]() { return scheduler.pending > 0; });
+    }
+}
+
+// Start the workers; the caller holds scheduler.mutex
+static void startScheduler(TaskScheduler& scheduler) {
+    if (scheduler.started) {
+        return;
+    }
+    if (scheduler.numThreads <= 0) {
+        scheduler.numThreads = std::max(1, int(std::thread::hardware_concurrency()));
+    }
+    for (int i = 0; i < scheduler.numThreads; ++i) {
+        scheduler.queues.push_back(std::make_unique<TaskQueue>());
+    }
+    for (int i = 0; i < scheduler.numThreads; ++i) {
+        std::thread(schedulerWorker, i).detach();
+    }
+    scheduler.started = true;
+}
+
+static void submitTask(std::function<void()> task) {
+    TaskScheduler& scheduler = taskScheduler();
+    std::unique_lock<std::mutex> lock(scheduler.mutex);
+    startScheduler(scheduler);
+    int worker = currentWorker >= 0 ? currentWorker : int(scheduler.nextQueue++ % unsigned(scheduler.queues.size()));
+    {
+        TaskQueue& queue = *scheduler.queues[size_t(worker)];
+        std::lock_guard<std::mutex> queueLock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    ++scheduler.pending;
+    lock.unlock();
+    scheduler.wake.notify_one();
+}
+
+int mediaLibraryInit(const MediaLibraryConfig* config) {
+    TaskScheduler& scheduler = taskScheduler();
+    std::lock_guard<std::mutex> lock(scheduler.mutex);
+    if (scheduler.started) {
+        return 0; // Too late: the workers are already running
+    }
+    if (config) {
+        scheduler.numThreads = config->numThreads;
+        if (config->cpuAffinity && config->numCpuAffinity > 0) {
+            scheduler.affinity.assign(config->cpuAffinity, config->cpuAffinity + config->numCpuAffinity);
+        }
+    }
+    startScheduler(scheduler);
+    return 1;
+}
+
+// Batch remux jobs. Jobs queue up and run on the shared scheduler, at most concurrency at a time;
+// remuxing is mostly disk-bound, so the default is half the cores (at least two), not one per core.
+struct RemuxJob {
+    long long id = 0;
+    std::string srcFilePath;
+    std::string destFilePath;
+    std::string outputFormat;
+    RemuxOptions options{};
+    std::vector<int> streamIndices;
+    RemuxJobCallback callback = nullptr;
+    void* user = nullptr;
+    MediaCancelToken cancelToken;
+    MediaCallControl control{};       // The caller's deadline with the job's own token; progress goes to callback
+    RemuxMonitor monitor;
+    std::atomic<int> state{MEDIA_JOB_QUEUED};
+    std::chrono::steady_clock::time_point finished;
+    std::mutex mutex;
+    std::condition_variable done;
+};
+
+struct RemuxJobQueue {
+    std::mutex mutex;
+    std::deque<std::shared_ptr<RemuxJob>> pending;
+    std::map<long long, std::shared_ptr<RemuxJob>> jobs;
+    int running = 0; // Scheduler tasks currently working through pending
+    int concurrency = std::max(2, int(std::thread::hardware_concurrency()) / 2);
+    long long nextId = 1;
+};
+
+static RemuxJobQueue& remuxJobQueue() {
+    // Intentionally leaked so worker threads never outlive the queue during static destruction
+    static auto* queue = new RemuxJobQueue();
+    return *queue;
+}
+
+static bool remuxJobFinished(int state) {
+    return state == MEDIA_JOB_SUCCEEDED || state == MEDIA_JOB_FAILED || state == MEDIA_JOB_CANCELLED;
+}
+
+static void fillRemuxProgress(RemuxJob* job, RemuxProgress* progress) {
+    int state = job->state.load();
+    auto end = remuxJobFinished(state) ? job->finished : std::chrono::steady_clock::now();
+    double elapsed = state == MEDIA_JOB_QUEUED ? 0 : std::chrono::duration<double>(end - job->monitor.started).count();
+    progress->state = state;
+    progress->bytesRead = job->monitor.bytesRead.load(std::memory_order_relaxed);
+    progress->bytesWritten = job->monitor.bytesWritten.load(std::memory_order_relaxed);
+    progress->processedSeconds = double(job->monitor.processedTime.load(std::memory_order_relaxed)) / AV_TIME_BASE;
+    progress->durationSeconds = double(job->monitor.duration.load(std::memory_order_relaxed)) / AV_TIME_BASE;
+    progress->bytesPerSecond = elapsed > 0 ? double(progress->bytesRead) / elapsed : 0;
+}
+
+static void notifyRemuxJob(RemuxJob* job) {
+    if (job->callback) {
+        RemuxProgress progress{};
+        fillRemuxProgress(job, &progress);
+        job->callback(job->id, &progress, job->user);
+    }
+}
+
+static void runRemuxJob(const std::shared_ptr<RemuxJob>& job) {
+    job->monitor.started = std::chrono::steady_clock::now();
+    job->state = MEDIA_JOB_RUNNING;
+    job->monitor.report = [raw = job.get()]() { notifyRemuxJob(raw); };
+    notifyRemuxJob(job.get());
+
+    CallGuard guard = makeCallGuard(&job->control);
+    RemuxTask task;
+    task.monitor = &job->monitor;
+    task.guard = &guard;
+    int ok = job->cancelToken.cancelled ? 0 : remuxMedia(job->srcFilePath.c_str(), job->destFilePath.c_str(), job->outputFormat.c_str(), &job->options, &task);
+    if (ok == remuxIncompatible) {
+        TranscodeOptions fallback{};
+        fallback.copyCompatibleStreams = 1;
+        fallback.control = &job->control;
+        ok = transcodeMediaFile(job->srcFilePath.c_str(), job->destFilePath.c_str(), job->outputFormat.c_str(), &fallback, &job->monitor, &guard);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        job->finished = std::chrono::steady_clock::now();
+        job->state = ok ? MEDIA_JOB_SUCCEEDED : job->cancelToken.cancelled ? MEDIA_JOB_CANCELLED : MEDIA_JOB_FAILED;
+    }
+    job->done.notify_all();
+    notifyRemuxJob(job.get());
+}
+
+// A scheduler task that runs queued jobs until none are left
+static void remuxWorker() {
+    RemuxJobQueue& queue = remuxJobQueue();
+    while (true) {
+        std::shared_ptr<RemuxJob> job;
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.pending.empty() || queue.running > queue.concurrency) {
+                --queue.running;
+                return;
+            }
+            job = queue.pending.front();
+            queue.pending.pop_front();
+        }
+        runRemuxJob(job);
+    }
+}
+
+// Start worker tasks for queued jobs, up to the concurrency limit; the caller holds queue.mutex
+static void scheduleRemuxJobs(RemuxJobQueue& queue) {
+    for (size_t i = 0; i < queue.pending.size() && queue.running < queue.concurrency; ++i) {
+        ++queue.running;
+        submitTask(remuxWorker);
+    }
+}
+
+long long submitRemuxJob(const char* srcFilePath, const char* destDirPath, const char* outputFileName, const char* outputFormat, const RemuxOptions* options, RemuxJobCallback callback, void* user) {
+    if (!srcFilePath || !destDirPath || !outputFileName || !outputFormat) {
+        return -1; // Missing path or format; no job is created
+    }
+    auto job = std::make_shared<RemuxJob>();
+    char destFilePath[1024];
+    snprintf(destFilePath, sizeof(destFilePath), "%s/%s.%s", destDirPath, outputFileName, outputFormat);
+    job->srcFilePath = srcFilePath;
+    job->destFilePath = destFilePath;
+    job->outputFormat = outputFormat;
+    job->callback = callback;
+    job->user = user;
+
+    // Keep a private copy of the options, including the stream list the caller may free
+    if (options) {
+        job->options = *options;
+        if (options->streamIndices && options->numStreamIndices > 0) {
+            job->streamIndices.assign(options->streamIndices, options->streamIndices + options->numStreamIndices);
+            job->options.streamIndices = job->streamIndices.data();
+        }
+        if (options->control) {
+            job->control = *options->control;
+        }
+    }
+    job->control.cancelToken = &job->cancelToken;
+    job->control.progress = nullptr;
+    job->options.control = &job->control;
+
+    RemuxJobQueue& queue = remuxJobQueue();
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        job->id = queue.nextId++;
+        queue.jobs[job->id] = job;
+        queue.pending.push_back(job);
+        scheduleRemuxJobs(queue);
+    }
+    return job->id;
+}
+
+static std::shared_ptr<RemuxJob> findRemuxJob(long long jobId) {
+    RemuxJobQueue& queue = remuxJobQueue();
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    auto it = queue.jobs.find(jobId);
+    return it != queue.jobs.end() ? it->second : nullptr;
+}
+
+int getRemuxJobProgress(long long jobId, RemuxProgress* progress) {
+    std::shared_ptr<RemuxJob> job = findRemuxJob(jobId);
+    if (!job || !progress) {
+        return 0; // Unknown job
+    }
+    fillRemuxProgress(job.get(), progress);
+    return 1;
+}
+
+int waitRemuxJob(long long jobId) {
+    std::shared_ptr<RemuxJob> job = findRemuxJob(jobId);
+    if (!job) {
+        return 0; // Unknown job
+    }
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->done.wait(lock, [&job]() { return remuxJobFinished(job->state); });
+    return job->state == MEDIA_JOB_SUCCEEDED ? 1 : 0;
+}
+
+// A queued job is dropped when it comes up; a running one stops at its next packet
+int cancelRemuxJob(long long jobId) {
+    std::shared_ptr<RemuxJob> job = findRemuxJob(jobId);
+    if (!job) {
+        return 0; // Unknown job
+    }
+    job->cancelToken.cancelled = true;
+    return 1;
+}
+
+void releaseRemuxJob(long long jobId) {
+    RemuxJobQueue& queue = remuxJobQueue();
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.jobs.erase(jobId);
+}
+
+void setRemuxJobConcurrency(int numThreads) {
+    RemuxJobQueue& queue = remuxJobQueue();
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    // Running jobs finish; a lower limit takes effect as they do, a higher one right away
+    queue.concurrency = std::max(1, numThreads);
+    scheduleRemuxJobs(queue);
+}
+
+// Per-thread image buffer pools keyed by (format, width, height), so repeated thumbnail calls on a
+// worker thread reuse the same frames and pixel buffers instead of allocating and faulting in new
+// ones every time. Bytes held by a thread's pools are capped; least recently used pools go first.
+// A cap of 0 turns pooling off: each thread drops what it holds on its next call and keeps nothing.
+static std::atomic<int64_t> framePoolLimit{64 * 1024 * 1024};
+
+struct FramePool {
+    AVBufferPool* pool = nullptr;
+    int64_t bufferSize = 0;
+    int64_t allocatedBytes = 0;
+    uint64_t lastUsed = 0;
+};
+
+struct FramePools {
+    std::map<std::tuple<int, int, int>, FramePool*> pools;
+    std::vector<AVFrame*> spareFrames;
+    int64_t retainedBytes = 0;
+    uint64_t useCounter = 0;
+
+    ~FramePools() {
+        clear();
+    }
+
+    void evict(std::map<std::tuple<int, int, int>, FramePool*>::iterator it) {
+        retainedBytes -= it->second->allocatedBytes;
+        // Buffers still in use stay valid; the pool frees them once they come back
+        av_buffer_pool_uninit(&it->second->pool);
+        delete it->second;
+        pools.erase(it);
+    }
+
+    void clear() {
+        while (!pools.empty()) {
+            evict(pools.begin());
+        }
+        for (AVFrame* frame : spareFrames) {
+            av_frame_free(&frame);
+        }
+        spareFrames.clear();
+    }
+};
+
+static thread_local FramePools framePools;
+
+static AVBufferRef* allocPooledBuffer(void* opaque, size_t size) {
+    auto* pool = static_cast<FramePool*>(opaque);
+    AVBufferRef* buffer = av_buffer_alloc(size);
+    if (buffer) {
+        pool->allocatedBytes += int64_t(size);
+        framePools.retainedBytes += int64_t(size);
+    }
+    return buffer;
+}
+
+// Take a blank frame from this thread's spares
+static AVFrame* acquireFrame() {
+    if (framePools.spareFrames.empty()) {
+        return av_frame_alloc();
+    }
+    AVFrame* frame = framePools.spareFrames.back();
+    framePools.spareFrames.pop_back();
+    return frame;
+}
+
+// Drop the frame's references and keep it for the next call on this thread
+static void releaseFrame(AVFrame** frame) {
+    if (!*frame) {
+        return;
+    }
+    av_frame_unref(*frame);
+    if (framePoolLimit.load(std::memory_order_relaxed) > 0 && framePools.spareFrames.size() < 8) {
+        framePools.spareFrames.push_back(*frame);
+    } else {
+        av_frame_free(frame);
+    }
+    *frame = nullptr;
+}
+
+// Attach a pooled image buffer of the given format and size to a blank frame
+static int allocPooledImage(AVFrame* frame, enum AVPixelFormat format, int width, int height) {
+    int numBytes = av_image_get_buffer_size(format, width, height, 32);
+    if (numBytes < 0) {
+        return numBytes;
+    }
+
+    int64_t limit = framePoolLimit.load(std::memory_order_relaxed);
+    if (limit <= 0) {
+        // Pooling is off: free anything still held from before and give the frame its own buffer
+        framePools.clear();
+        frame->buf[0] = av_buffer_alloc(size_t(numBytes));
+        if (!frame->buf[0]) {
+            return AVERROR(ENOMEM);
+        }
+        frame->format = format;
+        frame->width = width;
+        frame->height = height;
+        return av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data, format, width, height, 32);
+    }
+
+    auto key = std::make_tuple(int(format), width, height);
+    auto it = framePools.pools.find(key);
+    if (it == framePools.pools.end()) {
+        // Make room for at least one buffer of the new size before adding its pool
+        while (!framePools.pools.empty() && framePools.retainedBytes + numBytes > limit) {
+            auto oldest = std::min_element(framePools.pools.begin(), framePools.pools.end(), [](const auto& a, const auto& b) {
+                return a.second->lastUsed < b.second->lastUsed;
+            });
+            framePools.evict(oldest);
+        }
+        auto* pool = new FramePool();
+        pool->bufferSize = numBytes;
+        pool->pool = av_buffer_pool_init2(size_t(numBytes), pool, allocPooledBuffer, nullptr);
+        if (!pool->pool) {
+            delete pool;
+            return AVERROR(ENOMEM);
+        }
+        it = framePools.pools.emplace(key, pool).first;
+    }
+    it->second->lastUsed = ++framePools.useCounter;
+
+    frame->buf[0] = av_buffer_pool_get(it->second->pool);
+    if (!frame->buf[0]) {
+        return AVERROR(ENOMEM);
+    }
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    return av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data, format, width, height, 32);
+}
+
+void setFramePoolLimit(long long maxRetainedBytes) {
+    framePoolLimit.store(maxRetainedBytes > 0 ? maxRetainedBytes : 0, std::memory_order_relaxed);
+}
+
+void releaseFramePools() {
+    framePools.clear();
+}
+
+int saveAsJPEG(const char* filename, uint8_t* buffer, int width, int height, int stride) {
+    struct jpeg_compress_struct cinfo{};
+    struct jpeg_error_mgr jerr{};
+
+    // Open the output file
+    FILE* outfile = fopen(filename, "wb");
+    if (!outfile) {
+        fprintf(stderr, "Error: Could not open output file %s\n", filename);
+        return -1;
+    }
+
+    // Initialize the JPEG compression object
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, outfile);
+
+    // Set the image parameters
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3; // RGB
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 85, TRUE); // Quality (0-100)
+
+    // Start compression
+    jpeg_start_compress(&cinfo, TRUE);
+
+    // Write each row of the image
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row_pointer[1] = {buffer + cinfo.next_scanline * stride};
+        jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    }
+
+    // Finish compression
+    jpeg_finish_compress(&cinfo);
+    fclose(outfile);
+    jpeg_destroy_compress(&cinfo);
+
+    return 0; // Success
+}
+
+// Cover art: the attached_pic packet of an AV_DISPOSITION_ATTACHED_PIC stream. The demuxer reads
+// it with the header, so it needs no packet reads, and no decoding when it's wanted as is.
+static const AVStream* findCoverArt(const AVFormatContext* formatContext) {
+    for (unsigned int i = 0; i < formatContext->nb_streams; ++i) {
+        const AVStream* stream = formatContext->streams[i];
+        if ((stream->disposition & AV_DISPOSITION_ATTACHED_PIC) && stream->attached_pic.size > 0) {
+            return stream;
+        }
+    }
+    return nullptr;
+}
+
+// File extension for image codecs whose packets are complete image files, else nullptr
+static const char* coverArtExtension(enum AVCodecID codecId) {
+    switch (codecId) {
+        case AV_CODEC_ID_MJPEG: return "jpg";
+        case AV_CODEC_ID_PNG: return "png";
+        case AV_CODEC_ID_WEBP: return "webp";
+        case AV_CODEC_ID_BMP: return "bmp";
+        case AV_CODEC_ID_GIF: return "gif";
+        default: return nullptr;
+    }
+}
+
+static int writeCoverArtBytes(const char* filePath, const AVStream* stream) {
+    FILE* file = fopen(filePath, "wb");
+    if (!file) {
+        return -1; // Couldn't create output file
+    }
+    bool ok = fwrite(stream->attached_pic.data, 1, size_t(stream->attached_pic.size), file) == size_t(stream->attached_pic.size);
+    return fclose(file) == 0 && ok ? 1 : -1;
+}
+
+// Decode the cover art, scale it to width x height (one of them 0 keeps the aspect ratio, both 0
+// the size) and save it as a JPEG
+static int saveCoverArtAsJPEG(const AVStream* stream, const char* filePath, int width, int height) {
+    const AVCodec* codec = avcodec_find_decoder(stream->codecpar->codec_id);
+    AVCodecContext* codecContext = codec ? avcodec_alloc_context3(codec) : nullptr;
+    AVFrame* frame = acquireFrame();
+    AVFrame* frameRGB = acquireFrame();
+    struct SwsContext* swsContext = nullptr;
+    int ret = -1;
+
+    enterPhase(MEDIA_PHASE_CODEC_OPEN);
+    bool opened = codecContext && frame && frameRGB && avcodec_parameters_to_context(codecContext, stream->codecpar) >= 0 && avcodec_open2(codecContext, codec, nullptr) >= 0;
+    enterPhase(MEDIA_PHASE_DECODE);
+    if (opened && avcodec_send_packet(codecContext, &stream->attached_pic) >= 0 && avcodec_send_packet(codecContext, nullptr) >= 0 &&
+        avcodec_receive_frame(codecContext, frame) >= 0) {
+        countDecodedFrame();
+        enterPhase(MEDIA_PHASE_SCALE);
+        if (width <= 0 && height <= 0) {
+            width = frame->width;
+            height = frame->height;
+        } else if (width <= 0) {
+            width = std::max(1, int(int64_t(frame->width) * height / frame->height));
+        } else if (height <= 0) {
+            height = std::max(1, int(int64_t(frame->height) * width / frame->width));
+        }
+        swsContext = sws_getContext(frame->width, frame->height, (enum AVPixelFormat)frame->format, width, height, AV_PIX_FMT_RGB24, SWS_BILINEAR, nullptr, nullptr, nullptr);
+        if (swsContext && allocPooledImage(frameRGB, AV_PIX_FMT_RGB24, width, height) >= 0) {
+            sws_scale(swsContext, (uint8_t const* const*)frame->data, frame->linesize, 0, frame->height, frameRGB->data, frameRGB->linesize);
+            enterPhase(MEDIA_PHASE_WRITE);
+            ret = saveAsJPEG(filePath, frameRGB->data[0], width, height, frameRGB->linesize[0]) == 0 ? 1 : -1;
+        }
+    }
+
+    sws_freeContext(swsContext);
+    releaseFrame(&frame);
+    releaseFrame(&frameRGB);
+    avcodec_free_context(&codecContext);
+    return ret;
+}
+
+int generateThumbnail(const char* srcFilePath, const char* outputDirPath, const char* outputFileName, const char* outputFormat, int width, int height) {
+    CallScope scope;
+    AVFormatContext* formatContext = nullptr;
+    AVCodecContext* codecContext = nullptr;
+    AVFrame* frame = nullptr;
+    AVFrame* frameRGB = nullptr;
+    AVPacket packet;
+    struct SwsContext* swsContext = nullptr;
+    int videoStreamIndex = -1;
+    int ret = 0;
+
+    // Open input file
+    enterPhase(MEDIA_PHASE_OPEN);
+    if (avformat_open_input(&formatContext, srcFilePath, nullptr, nullptr) != 0) {
+        return -1; // Couldn't open file
+    }
+
+    // Retrieve stream information
+    enterPhase(MEDIA_PHASE_PROBE);
+    if (avformat_find_stream_info(formatContext, nullptr) < 0) {
+        closeInput(&formatContext);
+        return -1; // Couldn't find stream information
+    }
+
+    // Find the first video stream
+    for (unsigned int i = 0; i < formatContext->nb_streams; ++i) {
+        if (formatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            videoStreamIndex = int(i);
+            break;
+        }
+    }
+    if (videoStreamIndex == -1) {
+        closeInput(&formatContext);
+        return -1; // Didn't find a video stream
+    }
+
+    // Cover art is already in memory: write a JPEG as is when it's the requested size, otherwise
+    // decode that one picture without reading any packets
+    AVStream* videoStream = formatContext->streams[videoStreamIndex];
+    if ((videoStream->disposition & AV_DISPOSITION_ATTACHED_PIC) && videoStream->attached_pic.size > 0) {
+        char thumbnailFilePath[1024];
+        snprintf(thumbnailFilePath, sizeof(thumbnailFilePath), "%s/%s.%s", outputDirPath, outputFileName, outputFormat);
+        enterPhase(MEDIA_PHASE_WRITE);
+        if (strcmp(outputFormat, "jpeg") == 0 || strcmp(outputFormat, "jpg") == 0) {
+            bool asIs = videoStream->codecpar->codec_id == AV_CODEC_ID_MJPEG && videoStream->codecpar->width == width && videoStream->codecpar->height == height;
+            ret = asIs ? writeCoverArtBytes(thumbnailFilePath, videoStream) : saveCoverArtAsJPEG(videoStream, thumbnailFilePath, width, height);
+            ret = ret == 1 ? 1 : 0;
+        }
+        closeInput(&formatContext);
+        return ret;
+    }
+
+    // Get codec parameters and find decoder
+    enterPhase(MEDIA_PHASE_CODEC_OPEN);
+    AVCodecParameters* codecParameters = formatContext->streams[videoStreamIndex]->codecpar;
+    auto* codec = const_cast<AVCodec *>(avcodec_find_decoder(codecParameters->codec_id));
+    if (!codec) {
+        closeInput(&formatContext);
+        return -1; // Codec not found
+    }
+
+    // Allocate codec context
+    codecContext = avcodec_alloc_context3(codec);
+    if (!codecContext) {
+        closeInput(&formatContext);
+        return -1; // Could not allocate codec context
+    }
+
+    // Copy codec parameters to codec context
+    if (avcodec_parameters_to_context(codecContext, codecParameters) < 0) {
+        avcodec_free_context(&codecContext);
+        closeInput(&formatContext);
+        return -1; // Could not copy codec parameters
+    }
+
+    // Open codec
+    if (avcodec_open2(codecContext, codec, nullptr) < 0) {
+        avcodec_free_context(&codecContext);
+        closeInput(&formatContext);
+        return -1; // Could not open codec
+    }
+
+    // Allocate frames from this thread's spares
+    frame = acquireFrame();
+    frameRGB = acquireFrame();
+    if (!frame || !frameRGB) {
+        releaseFrame(&frame);
+        releaseFrame(&frameRGB);
+        avcodec_free_context(&codecContext);
+        closeInput(&formatContext);
+        return -1; // Could not allocate frame
+    }
+
+    // Attach a pooled buffer for the RGB frame
+    if (allocPooledImage(frameRGB, AV_PIX_FMT_RGB24, width, height) < 0) {
+        releaseFrame(&frame);
+        releaseFrame(&frameRGB);
+        avcodec_free_context(&codecContext);
+        closeInput(&formatContext);
+        return -1; // Could not allocate buffer
+    }
+
+    // Initialize SWS context for software scaling
+    swsContext = sws_getContext(codecContext->width, codecContext->height, codecContext->pix_fmt, width, height, AV_PIX_FMT_RGB24, SWS_BILINEAR, nullptr, nullptr, nullptr);
+    if (!swsContext) {
+        releaseFrame(&frame);
+        releaseFrame(&frameRGB);
+        avcodec_free_context(&codecContext);
+        closeInput(&formatContext);
+        return -1; // Could not initialize SWS context
+    }
+
+    // Read frames and save the first frame as a thumbnail
+    enterPhase(MEDIA_PHASE_DECODE);
+    while (av_read_frame(formatContext, &packet) >= 0) {
+        if (packet.stream_index == videoStreamIndex) {
+            if (avcodec_send_packet(codecContext, &packet) == 0) {
+                if (avcodec_receive_frame(codecContext, frame) == 0) {
+                    countDecodedFrame();
+
+                    // Convert the image from its native format to RGB
+                    enterPhase(MEDIA_PHASE_SCALE);
+                    sws_scale(swsContext, (uint8_t const* const*)frame->data, frame->linesize, 0, codecContext->height, frameRGB->data, frameRGB->linesize);
+
+                    // Construct thumbnail file path
+                    char thumbnailFilePath[1024];
+                    snprintf(thumbnailFilePath, sizeof(thumbnailFilePath), "%s/%s.%s", outputDirPath, outputFileName, outputFormat);
+
+                    // Save as JPEG
+                    enterPhase(MEDIA_PHASE_WRITE);
+                    if (strcmp(outputFormat, "jpeg") == 0 || strcmp(outputFormat, "jpg") == 0) {
+                        if (saveAsJPEG(thumbnailFilePath, frameRGB->data[0], width, height, frameRGB->linesize[0]) == 0) {
+                            ret = 1; // Success
+                        }
+                    }
+                    break;
+                }
+            }
+        }
+        av_packet_unref(&packet);
+    }
+
+    // Free resources
+    sws_freeContext(swsContext);
+    releaseFrame(&frame);
+    releaseFrame(&frameRGB);
+    avcodec_free_context(&codecContext);
+    closeInput(&formatContext);
+
+    return ret;
+}
+
+// Writes the embedded cover art to <outputDirPath>/<outputFileName>.<ext>. With no size the
+// picture's own bytes are written as they are (ext from its codec: jpg, png, ...); with a size, or
+// for codecs that aren't image files, it's decoded, scaled and saved as .jpg.
+int extractCoverArt(const char* srcFilePath, const char* outputDirPath, const char* outputFileName, int width, int height) {
+    CallScope scope;
+    AVFormatContext* formatContext = nullptr;
+    enterPhase(MEDIA_PHASE_OPEN);
+    if (avformat_open_input(&formatContext, srcFilePath, nullptr, nullptr) != 0) {
+        return -1; // Couldn't open file
+    }
+    const AVStream* coverArt = findCoverArt(formatContext);
+    if (!coverArt) {
+        closeInput(&formatContext);
+        return -1; // No cover art
+    }
+
+    const char* extension = coverArtExtension(coverArt->codecpar->codec_id);
+    bool asIs = width <= 0 && height <= 0 && extension;
+    char outputFilePath[1024];
+    snprintf(outputFilePath, sizeof(outputFilePath), "%s/%s.%s", outputDirPath, outputFileName, asIs ? extension : "jpg");
+    enterPhase(MEDIA_PHASE_WRITE);
+    int ret = asIs ? writeCoverArtBytes(outputFilePath, coverArt) : saveCoverArtAsJPEG(coverArt, outputFilePath, width, height);
+    closeInput(&formatContext);
+    return ret;
+}
+
+// Copies the embedded cover art's bytes, undecoded, into *data (freed with releaseCoverArt).
+// Returns the AVCodecID of the picture, or -1 when there is none.
+int getCoverArt(const char* srcFilePath, uint8_t** data, int* size) {
+    CallScope scope;
+    if (!data || !size) {
+        return -1; // Nowhere to put the result
+    }
+    *data = nullptr;
+    *size = 0;
+    AVFormatContext* formatContext = nullptr;
+    enterPhase(MEDIA_PHASE_OPEN);
+    if (avformat_open_input(&formatContext, srcFilePath, nullptr, nullptr) != 0) {
+        return -1; // Couldn't open file
+    }
+    const AVStream* coverArt = findCoverArt(formatContext);
+    int codecId = coverArt ? int(coverArt->codecpar->codec_id) : -1;
+    if (coverArt) {
+        *data = static_cast<uint8_t*>(av_memdup(coverArt->attached_pic.data, size_t(coverArt->attached_pic.size)));
+        *size = *data ? coverArt->attached_pic.size : 0;
+        codecId = *data ? codecId : -1;
+    }
+    closeInput(&formatContext);
+    return codecId;
+}
+
+void releaseCoverArt(uint8_t* data) {
+    av_free(data);
+}
+
+char** generateThumbnails(const char* srcFilePath, const char* outputDirPath, int width, int height, int numThumbnails) {
+    CallScope scope;
+    return generateThumbnailsWithControl(srcFilePath, outputDirPath, width, height, numThumbnails, nullptr);
+}
+
+// Returns the paths written, null-terminated (so possibly fewer than numThumbnails); free the array
+// with releaseThumbnails
+char** generateThumbnailsWithControl(const char* srcFilePath, const char* outputDirPath, int width, int height, int numThumbnails, const MediaCallControl* control) {
+    CallScope scope;
+    char** thumbnails = new char*[size_t(std::max(numThumbnails, 0)) + 1]();
+    CallGuard guard = makeCallGuard(control);
+    AVFormatContext* formatContext = nullptr;
+    AVCodecContext* codecContext = nullptr;
+    AVFrame* frame = nullptr;
+    AVFrame* frameRGB = nullptr;
+    AVPacket packet;
+    struct SwsContext* swsContext = nullptr;
+    int videoStreamIndex = -1;
+
+    // Open input file, giving up on blocking I/O once the call is cancelled or out of time
+    enterPhase(MEDIA_PHASE_OPEN);
+    formatContext = avformat_alloc_context();
+    if (formatContext) {
+        setInterruptGuard(formatContext, &guard);
+    }
+    if (avformat_open_input(&formatContext, srcFilePath, nullptr, nullptr) != 0) {
+        return thumbnails; // Couldn't open file
+    }
+
+    // Retrieve stream information
+    enterPhase(MEDIA_PHASE_PROBE);
+    if (avformat_find_stream_info(formatContext, nullptr) < 0) {
+        closeInput(&formatContext);
+        return thumbnails; // Couldn't find stream information
+    }
+
+    // Find the first video stream
+    for (unsigned int i = 0; i < formatContext->nb_streams; ++i) {
+        if (formatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            videoStreamIndex = int(i);
+            break;
+        }
     }
     if (videoStreamIndex == -1) {
-        avformat_close_input(&formatContext);
+        closeInput(&formatContext);
         return thumbnails; // Didn't find a video stream
     }
 
-    // Get codec parameters and find decoder
-    AVCodecParameters* codecParameters = formatContext->streams[videoStreamIndex]->codecpar;
-    auto* codec = const_cast<AVCodec *>(avcodec_find_decoder(codecParameters->codec_id));
-    if (!codec) {
-        avformat_close_input(&formatContext);
-        return thumbnails; // Codec not found
+    // Get codec parameters and find decoder
+    enterPhase(MEDIA_PHASE_CODEC_OPEN);
+    AVCodecParameters* codecParameters = formatContext->streams[videoStreamIndex]->codecpar;
+    auto* codec = const_cast<AVCodec *>(avcodec_find_decoder(codecParameters->codec_id));
+    if (!codec) {
+        closeInput(&formatContext);
+        return thumbnails; // Codec not found
+    }
+
+    // Allocate codec context
+    codecContext = avcodec_alloc_context3(codec);
+    if (!codecContext) {
+        closeInput(&formatContext);
+        return thumbnails; // Could not allocate codec context
+    }
+
+    // Copy codec parameters to codec context
+    if (avcodec_parameters_to_context(codecContext, codecParameters) < 0) {
+        avcodec_free_context(&codecContext);
+        closeInput(&formatContext);
+        return thumbnails; // Could not copy codec parameters
+    }
+
+    // Open codec
+    if (avcodec_open2(codecContext, codec, nullptr) < 0) {
+        avcodec_free_context(&codecContext);
+        closeInput(&formatContext);
+        return thumbnails; // Could not open codec
+    }
+
+    // Allocate frames from this thread's spares
+    frame = acquireFrame();
+    frameRGB = acquireFrame();
+    if (!frame || !frameRGB) {
+        releaseFrame(&frame);
+        releaseFrame(&frameRGB);
+        avcodec_free_context(&codecContext);
+        closeInput(&formatContext);
+        return thumbnails; // Could not allocate frame
+    }
+
+    // Attach a pooled buffer for the RGB frame
+    if (allocPooledImage(frameRGB, AV_PIX_FMT_RGB24, width, height) < 0) {
+        releaseFrame(&frame);
+        releaseFrame(&frameRGB);
+        avcodec_free_context(&codecContext);
+        closeInput(&formatContext);
+        return thumbnails; // Could not allocate buffer
+    }
+
+    // Initialize SWS context for software scaling
+    swsContext = sws_getContext(codecContext->width, codecContext->height, codecContext->pix_fmt, width, height, AV_PIX_FMT_RGB24, SWS_BILINEAR, nullptr, nullptr, nullptr);
+    if (!swsContext) {
+        releaseFrame(&frame);
+        releaseFrame(&frameRGB);
+        avcodec_free_context(&codecContext);
+        closeInput(&formatContext);
+        return thumbnails; // Could not initialize SWS context
+    }
+
+    // Read frames and save thumbnails
+    enterPhase(MEDIA_PHASE_DECODE);
+    int frameCount = 0;
+    while (!guard.stopped() && frameCount < numThumbnails && av_read_frame(formatContext, &packet) >= 0) {
+        if (packet.stream_index == videoStreamIndex) {
+            if (avcodec_send_packet(codecContext, &packet) == 0) {
+                if (avcodec_receive_frame(codecContext, frame) == 0) {
+                    countDecodedFrame();
+
+                    // Convert the image from its native format to RGB
+                    enterPhase(MEDIA_PHASE_SCALE);
+                    sws_scale(swsContext, (uint8_t const* const*)frame->data, frame->linesize, 0, codecContext->height, frameRGB->data, frameRGB->linesize);
+
+                    // Construct thumbnail file path
+                    char thumbnailFilePath[1024];
+                    snprintf(thumbnailFilePath, sizeof(thumbnailFilePath), "%s/thumbnail_%d.ppm", outputDirPath, frameCount);
+
+                    // Save the frame to a file
+                    enterPhase(MEDIA_PHASE_WRITE);
+                    FILE* file = fopen(thumbnailFilePath, "wb");
+                    if (file) {
+                        fprintf(file, "P6\n%d %d\n255\n", width, height);
+                        for (int y = 0; y < height; y++) {
+                            fwrite(frameRGB->data[0] + y * frameRGB->linesize[0], 1, width * 3, file);
+                        }
+                        fclose(file);
+                        thumbnails[frameCount] = av_strdup(thumbnailFilePath);
+                        if (!thumbnails[frameCount]) {
+                            av_packet_unref(&packet);
+                            break; // Out of memory; return the paths so far
+                        }
+                        frameCount++;
+                        if (control && control->progress) {
+                            control->progress(double(frameCount) / numThumbnails, control->user);
+                        }
+                    }
+                    enterPhase(MEDIA_PHASE_DECODE);
+                }
+            }
+        }
+        av_packet_unref(&packet);
+    }
+
+    // Free resources
+    sws_freeContext(swsContext);
+    releaseFrame(&frame);
+    releaseFrame(&frameRGB);
+    avcodec_free_context(&codecContext);
+    closeInput(&formatContext);
+
+    return thumbnails;
+}
+
+void releaseThumbnails(char** thumbnails) {
+    if (!thumbnails) {
+        return;
+    }
+    for (char** path = thumbnails; *path; ++path) {
+        av_free(*path);
+    }
+    delete[] thumbnails;
+}
+
+
+// Open a decoder for the first video stream of an already probed input
+static int openVideoDecoder(AVFormatContext* formatContext, int* videoStreamIndex, AVCodecContext** codecContext) {
+    enterPhase(MEDIA_PHASE_CODEC_OPEN);
+    *videoStreamIndex = -1;
+    for (unsigned int i = 0; i < formatContext->nb_streams; ++i) {
+        if (formatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            *videoStreamIndex = int(i);
+            break;
+        }
+    }
+    if (*videoStreamIndex == -1) {
+        return -1; // Didn't find a video stream
+    }
+
+    AVCodecParameters* codecParameters = formatContext->streams[*videoStreamIndex]->codecpar;
+    const AVCodec* codec = avcodec_find_decoder(codecParameters->codec_id);
+    if (!codec) {
+        return -1; // Codec not found
+    }
+
+    *codecContext = avcodec_alloc_context3(codec);
+    if (!*codecContext) {
+        return -1; // Could not allocate codec context
+    }
+    if (avcodec_parameters_to_context(*codecContext, codecParameters) < 0 || avcodec_open2(*codecContext, codec, nullptr) < 0) {
+        avcodec_free_context(codecContext);
+        return -1; // Could not open codec
+    }
+    (*codecContext)->pkt_timebase = formatContext->streams[*videoStreamIndex]->time_base;
+    return 0;
+}
+
+// Seek to the keyframe at or before timestamp (in stream time base) and decode forward to the
+// first frame at or past it. Near the end of the stream the last frame the decoder yields is used.
+static int decodeFrameAt(AVFormatContext* formatContext, AVCodecContext* codecContext, int videoStreamIndex, int64_t timestamp, AVFrame* frame, const KeyframeIndex* index) {
+    AVPacket packet;
+
+    enterPhase(MEDIA_PHASE_DECODE);
+    if (seekVideoStream(formatContext, videoStreamIndex, timestamp, index) < 0) {
+        return -1; // Couldn't seek
+    }
+    avcodec_flush_buffers(codecContext);
+
+    while (av_read_frame(formatContext, &packet) >= 0) {
+        if (packet.stream_index != videoStreamIndex) {
+            av_packet_unref(&packet);
+            continue;
+        }
+        int sent = avcodec_send_packet(codecContext, &packet);
+        av_packet_unref(&packet);
+        if (sent < 0) {
+            continue; // Skip packets the decoder rejects (e.g. leading B-frames after a seek)
+        }
+        while (avcodec_receive_frame(codecContext, frame) == 0) {
+            countDecodedFrame();
+            if (frame->best_effort_timestamp == AV_NOPTS_VALUE || frame->best_effort_timestamp >= timestamp) {
+                return 0;
+            }
+            av_frame_unref(frame);
+        }
+    }
+
+    // Drain the decoder at end of file and keep the last frame it returns
+    avcodec_send_packet(codecContext, nullptr);
+    AVFrame* last = av_frame_alloc();
+    if (!last) {
+        return -1;
+    }
+    int found = -1;
+    while (avcodec_receive_frame(codecContext, last) == 0) {
+        countDecodedFrame();
+        av_frame_unref(frame);
+        av_frame_move_ref(frame, last);
+        found = 0;
+    }
+    av_frame_free(&last);
+    return found;
+}
+
+int generateAnimatedPreview(const char* srcFilePath, const char* outputDirPath, const char* outputFileName, const char* outputFormat, int width, int height, int numFrames, int frameDelayMs) {
+    CallScope scope;
+    AVFormatContext* formatContext = nullptr;
+    AVFormatContext* outputFormatContext = nullptr;
+    AVCodecContext* codecContext = nullptr;
+    AVCodecContext* encoderContext = nullptr;
+    AVFrame* frame = nullptr;
+    AVFrame* framePreview = nullptr;
+    AVPacket* packet = nullptr;
+    struct SwsContext* swsContext = nullptr;
+    KeyframeIndex keyframeIndex;
+    int videoStreamIndex = -1;
+    int ret = -1;
+
+    auto cleanup = [&]() {
+        unloadKeyframeIndex(&keyframeIndex);
+        sws_freeContext(swsContext);
+        av_packet_free(&packet);
+        releaseFrame(&frame);
+        releaseFrame(&framePreview);
+        avcodec_free_context(&encoderContext);
+        avcodec_free_context(&codecContext);
+        if (outputFormatContext && !(outputFormatContext->oformat->flags & AVFMT_NOFILE)) {
+            avio_closep(&outputFormatContext->pb);
+        }
+        avformat_free_context(outputFormatContext);
+        closeInput(&formatContext);
+    };
+
+    if (numFrames <= 0 || width <= 0 || height <= 0 || frameDelayMs <= 0) {
+        return -1; // Invalid arguments
+    }
+
+    // Pick the encoder and the pixel format it accepts without a palette pass
+    const AVCodec* encoder = nullptr;
+    enum AVPixelFormat encoderPixelFormat = AV_PIX_FMT_NONE;
+    if (strcmp(outputFormat, "gif") == 0) {
+        encoder = avcodec_find_encoder(AV_CODEC_ID_GIF);
+        encoderPixelFormat = AV_PIX_FMT_RGB8;
+    } else if (strcmp(outputFormat, "webp") == 0) {
+        encoder = avcodec_find_encoder_by_name("libwebp_anim");
+        encoderPixelFormat = AV_PIX_FMT_YUV420P;
+    }
+    if (!encoder) {
+        return -1; // Unsupported preview format or encoder not built in
+    }
+
+    // Open input file and its video decoder
+    enterPhase(MEDIA_PHASE_OPEN);
+    if (avformat_open_input(&formatContext, srcFilePath, nullptr, nullptr) != 0) {
+        return -1; // Couldn't open file
+    }
+    enterPhase(MEDIA_PHASE_PROBE);
+    if (avformat_find_stream_info(formatContext, nullptr) < 0 || openVideoDecoder(formatContext, &videoStreamIndex, &codecContext) < 0) {
+        cleanup();
+        return -1; // No decodable video stream
+    }
+
+    // Work out the span to sample from, in stream time base
+    AVStream* videoStream = formatContext->streams[videoStreamIndex];
+    int64_t startTime = videoStream->start_time != AV_NOPTS_VALUE ? videoStream->start_time : 0;
+    int64_t duration = videoStream->duration;
+    if (duration == AV_NOPTS_VALUE || duration <= 0) {
+        duration = formatContext->duration != AV_NOPTS_VALUE ? av_rescale_q(formatContext->duration, AV_TIME_BASE_Q, videoStream->time_base) : 0;
+    }
+
+    // Construct preview file path and output context
+    char previewFilePath[1024];
+    snprintf(previewFilePath, sizeof(previewFilePath), "%s/%s.%s", outputDirPath, outputFileName, outputFormat);
+    avformat_alloc_output_context2(&outputFormatContext, nullptr, outputFormat, previewFilePath);
+    if (!outputFormatContext) {
+        cleanup();
+        return -1; // Couldn't create output context
+    }
+
+    // Set up the encoder with a millisecond time base so each frame lasts frameDelayMs
+    enterPhase(MEDIA_PHASE_CODEC_OPEN);
+    encoderContext = avcodec_alloc_context3(encoder);
+    if (!encoderContext) {
+        cleanup();
+        return -1; // Could not allocate encoder context
+    }
+    encoderContext->width = width;
+    encoderContext->height = height;
+    encoderContext->pix_fmt = encoderPixelFormat;
+    encoderContext->time_base = AVRational{1, 1000};
+    if (outputFormatContext->oformat->flags & AVFMT_GLOBALHEADER) {
+        encoderContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    if (avcodec_open2(encoderContext, encoder, nullptr) < 0) {
+        cleanup();
+        return -1; // Could not open encoder
+    }
+
+    AVStream* outputStream = avformat_new_stream(outputFormatContext, nullptr);
+    if (!outputStream || avcodec_parameters_from_context(outputStream->codecpar, encoderContext) < 0) {
+        cleanup();
+        return -1; // Failed to create output stream
+    }
+    outputStream->time_base = encoderContext->time_base;
+
+    enterPhase(MEDIA_PHASE_WRITE);
+    if (!(outputFormatContext->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open(&outputFormatContext->pb, previewFilePath, AVIO_FLAG_WRITE) < 0) {
+            cleanup();
+            return -1; // Failed to open output file
+        }
+    }
+
+    // Loop forever, like a typical hover preview
+    AVDictionary* muxerOptions = nullptr;
+    av_dict_set(&muxerOptions, "loop", "0", 0);
+    int headerWritten = avformat_write_header(outputFormatContext, &muxerOptions);
+    av_dict_free(&muxerOptions);
+    if (headerWritten < 0) {
+        cleanup();
+        return -1; // Failed to write header
+    }
+
+    // Only one decoded frame and one scaled frame are ever alive at a time
+    frame = acquireFrame();
+    framePreview = acquireFrame();
+    packet = av_packet_alloc();
+    if (!frame || !framePreview || !packet) {
+        cleanup();
+        return -1; // Could not allocate frame
+    }
+    if (allocPooledImage(framePreview, encoderPixelFormat, width, height) < 0) {
+        cleanup();
+        return -1; // Could not allocate buffer
+    }
+
+    swsContext = sws_getContext(codecContext->width, codecContext->height, codecContext->pix_fmt, width, height, encoderPixelFormat, SWS_BILINEAR, nullptr, nullptr, nullptr);
+    if (!swsContext) {
+        cleanup();
+        return -1; // Could not initialize SWS context
+    }
+
+    // Use the sidecar index for the seeks when one was built for this file
+    loadKeyframeIndex(srcFilePath, &keyframeIndex);
+
+    // Encode each sample as soon as it is decoded, taking it from the middle of its slice of the video
+    auto writePackets = [&]() {
+        while (avcodec_receive_packet(encoderContext, packet) == 0) {
+            if (packet->duration == 0) {
+                packet->duration = frameDelayMs;
+            }
+            av_packet_rescale_ts(packet, encoderContext->time_base, outputStream->time_base);
+            packet->stream_index = outputStream->index;
+            enterPhase(MEDIA_PHASE_WRITE);
+            av_interleaved_write_frame(outputFormatContext, packet);
+            enterPhase(MEDIA_PHASE_ENCODE);
+        }
+    };
+    int framesWritten = 0;
+    for (int i = 0; i < numFrames; ++i) {
+        int64_t target = startTime + av_rescale(duration, 2 * i + 1, 2 * (int64_t)numFrames);
+        if (decodeFrameAt(formatContext, codecContext, videoStreamIndex, target, frame, &keyframeIndex) < 0) {
+            continue;
+        }
+        if (av_frame_make_writable(framePreview) < 0) {
+            av_frame_unref(frame);
+            break;
+        }
+        enterPhase(MEDIA_PHASE_SCALE);
+        sws_scale(swsContext, (uint8_t const* const*)frame->data, frame->linesize, 0, codecContext->height, framePreview->data, framePreview->linesize);
+        av_frame_unref(frame);
+
+        enterPhase(MEDIA_PHASE_ENCODE);
+        framePreview->pts = (int64_t)framesWritten * frameDelayMs;
+        framePreview->duration = frameDelayMs;
+        if (avcodec_send_frame(encoderContext, framePreview) < 0) {
+            break;
+        }
+        writePackets();
+        framesWritten++;
+    }
+
+    // Flush the encoder and finish the file
+    enterPhase(MEDIA_PHASE_ENCODE);
+    avcodec_send_frame(encoderContext, nullptr);
+    writePackets();
+    enterPhase(MEDIA_PHASE_WRITE);
+    if (av_write_trailer(outputFormatContext) == 0 && framesWritten > 0) {
+        ret = 1; // Success
+    }
+
+    cleanup();
+    return ret;
+}
+
+void initDecodeOptions(DecodeOptions* options) {
+    if (options) {
+        *options = DecodeOptions{};
+        options->pixelFormat = MEDIA_FORMAT_KEEP;
+    }
+}
+
+int decodeFrames(const char* srcFilePath, FrameCallback callback, void* user, const DecodeOptions* options) {
+    CallScope scope;
+    AVFormatContext* formatContext = nullptr;
+    AVCodecContext* codecContext = nullptr;
+    AVFrame* frame = nullptr;
+    AVFrame* frameScaled = nullptr;
+    AVPacket packet;
+    struct SwsContext* swsContext = nullptr;
+    int videoStreamIndex = -1;
+    DecodeOptions defaults;
+    initDecodeOptions(&defaults);
+    const DecodeOptions* opts = options ? options : &defaults;
+
+    auto cleanup = [&]() {
+        sws_freeContext(swsContext);
+        releaseFrame(&frame);
+        releaseFrame(&frameScaled);
+        avcodec_free_context(&codecContext);
+        closeInput(&formatContext);
+    };
+
+    if (!callback) {
+        return -1; // Nothing to deliver frames to
+    }
+
+    // Open input file and its video decoder
+    enterPhase(MEDIA_PHASE_OPEN);
+    if (avformat_open_input(&formatContext, srcFilePath, nullptr, nullptr) != 0) {
+        return -1; // Couldn't open file
+    }
+    enterPhase(MEDIA_PHASE_PROBE);
+    if (avformat_find_stream_info(formatContext, nullptr) < 0 || openVideoDecoder(formatContext, &videoStreamIndex, &codecContext) < 0) {
+        cleanup();
+        return -1; // No decodable video stream
+    }
+    AVStream* videoStream = formatContext->streams[videoStreamIndex];
+
+    // Let the decoder skip everything but keyframes instead of decoding and dropping them
+    if (opts->keyframesOnly) {
+        codecContext->skip_frame = AVDISCARD_NONKEY;
+    }
+
+    frame = acquireFrame();
+    if (!frame) {
+        cleanup();
+        return -1; // Could not allocate frame
+    }
+
+    // Only scale when the caller asked for a different size or pixel format; otherwise the
+    // decoder's own planes are handed out untouched
+    int width = opts->width > 0 ? opts->width : 0;
+    int height = opts->height > 0 ? opts->height : 0;
+    if (width > 0 && height == 0) {
+        height = int(av_rescale(width, codecContext->height, codecContext->width)) & ~1;
+    } else if (height > 0 && width == 0) {
+        width = int(av_rescale(height, codecContext->width, codecContext->height)) & ~1;
+    } else if (width == 0 && height == 0) {
+        width = codecContext->width;
+        height = codecContext->height;
+    }
+    enum AVPixelFormat pixelFormat = opts->pixelFormat >= 0 ? (enum AVPixelFormat)opts->pixelFormat : codecContext->pix_fmt;
+    bool scale = width != codecContext->width || height != codecContext->height || pixelFormat != codecContext->pix_fmt;
+    if (scale) {
+        frameScaled = acquireFrame();
+        if (!frameScaled) {
+            cleanup();
+            return -1; // Could not allocate frame
+        }
+        if (allocPooledImage(frameScaled, pixelFormat, width, height) < 0) {
+            cleanup();
+            return -1; // Could not allocate buffer
+        }
+    }
+
+    // Start at the keyframe before the requested time
+    if (opts->startTime > 0) {
+        int64_t target = av_rescale_q(int64_t(opts->startTime * AV_TIME_BASE), AV_TIME_BASE_Q, videoStream->time_base);
+        if (videoStream->start_time != AV_NOPTS_VALUE) {
+            target += videoStream->start_time;
+        }
+        KeyframeIndex keyframeIndex;
+        loadKeyframeIndex(srcFilePath, &keyframeIndex);
+        seekVideoStream(formatContext, videoStreamIndex, target, &keyframeIndex);
+        unloadKeyframeIndex(&keyframeIndex);
+    }
+
+    // Hand every decoded frame to the callback until it asks to stop
+    enterPhase(MEDIA_PHASE_DECODE);
+    int delivered = 0;
+    bool stop = false;
+    auto deliver = [&]() {
+        while (!stop && avcodec_receive_frame(codecContext, frame) == 0) {
+            countDecodedFrame();
+            AVFrame* output = frame;
+            if (scale) {
+                enterPhase(MEDIA_PHASE_SCALE);
+                // Decoded frames may differ from the codec parameters mid-stream, so the scaler follows the frame
+                swsContext = sws_getCachedContext(swsContext, frame->width, frame->height, (enum AVPixelFormat)frame->format, width, height, pixelFormat, SWS_BILINEAR, nullptr, nullptr, nullptr);
+                if (!swsContext || av_frame_make_writable(frameScaled) < 0) {
+                    stop = true;
+                    break;
+                }
+                sws_scale(swsContext, (uint8_t const* const*)frame->data, frame->linesize, 0, frame->height, frameScaled->data, frameScaled->linesize);
+                output = frameScaled;
+            }
+
+            MediaFrame mediaFrame{};
+            for (int plane = 0; plane < 4; ++plane) {
+                mediaFrame.data[plane] = output->data[plane];
+                mediaFrame.linesize[plane] = output->linesize[plane];
+            }
+            mediaFrame.width = output->width;
+            mediaFrame.height = output->height;
+            mediaFrame.pixelFormat = output->format;
+            mediaFrame.pts = frame->best_effort_timestamp;
+            mediaFrame.timestamp = frame->best_effort_timestamp != AV_NOPTS_VALUE ? double(frame->best_effort_timestamp) * av_q2d(videoStream->time_base) : -1;
+
+            enterPhase(MEDIA_PHASE_NONE); // The caller's own time
+            int result = callback(&mediaFrame, user);
+            enterPhase(MEDIA_PHASE_DECODE);
+            av_frame_unref(frame);
+            delivered++;
+            if (result != 0 || (opts->maxFrames > 0 && delivered >= opts->maxFrames)) {
+                stop = true;
+            }
+        }
+    };
+
+    while (!stop && av_read_frame(formatContext, &packet) >= 0) {
+        if (packet.stream_index == videoStreamIndex && avcodec_send_packet(codecContext, &packet) == 0) {
+            deliver();
+        }
+        av_packet_unref(&packet);
+    }
+
+    // Drain frames still held by the decoder
+    if (!stop && avcodec_send_packet(codecContext, nullptr) == 0) {
+        deliver();
+    }
+
+    cleanup();
+    return delivered;
+}
+
+// Decode exactly the frameNumber-th frame (0-based, presentation order) into frame
+static int decodeFrameNumber(AVFormatContext* formatContext, AVCodecContext* codecContext, int videoStreamIndex, int64_t frameNumber, AVFrame* frame, const KeyframeIndex* index) {
+    AVStream* videoStream = formatContext->streams[videoStreamIndex];
+
+    // With an index, start from the last keyframe numbered at or before the frame and count forward by PTS
+    if (index && index->header && index->header->streamIndex == videoStreamIndex && index->header->count > 0) {
+        const KeyframeIndexEntry* end = index->entries + index->header->count;
+        const KeyframeIndexEntry* next = std::upper_bound(index->entries, end, frameNumber, [](int64_t number, const KeyframeIndexEntry& entry) {
+            return number < entry.frameNumber;
+        });
+        const KeyframeIndexEntry* keyframe = next == index->entries ? index->entries : next - 1;
+        if (seekVideoStream(formatContext, videoStreamIndex, keyframe->pts, index) < 0) {
+            return -1; // Couldn't seek
+        }
+        avcodec_flush_buffers(codecContext);
+
+        enterPhase(MEDIA_PHASE_DECODE);
+        AVPacket packet;
+        int64_t current = keyframe->frameNumber;
+        int64_t lastPts = AV_NOPTS_VALUE;
+        bool draining = false;
+        while (true) {
+            if (!draining) {
+                if (av_read_frame(formatContext, &packet) < 0) {
+                    avcodec_send_packet(codecContext, nullptr);
+                    draining = true;
+                } else {
+                    int sent = packet.stream_index == videoStreamIndex ? avcodec_send_packet(codecContext, &packet) : -1;
+                    av_packet_unref(&packet);
+                    if (sent < 0) {
+                        continue;
+                    }
+                }
+            }
+            int received;
+            while ((received = avcodec_receive_frame(codecContext, frame)) == 0) {
+                countDecodedFrame();
+                int64_t pts = frame->best_effort_timestamp;
+                // Leading frames of an open GOP belong to the previous keyframe's count
+                if (pts == AV_NOPTS_VALUE || pts < keyframe->pts || (lastPts != AV_NOPTS_VALUE && pts <= lastPts)) {
+                    av_frame_unref(frame);
+                    continue;
+                }
+                if (lastPts != AV_NOPTS_VALUE) {
+                    current++;
+                }
+                lastPts = pts;
+                if (current == frameNumber) {
+                    return 0;
+                }
+                av_frame_unref(frame);
+            }
+            if (draining) {
+                return -1; // Frame number is past the end of the stream
+            }
+        }
+    }
+
+    // Constant frame rate: the frame's PTS follows directly from the rate, so seek by time
+    AVRational frameRate = videoStream->avg_frame_rate;
+    if (frameRate.num <= 0 || frameRate.den <= 0) {
+        return -1; // Frame rate unknown
+    }
+    int64_t startTime = videoStream->start_time != AV_NOPTS_VALUE ? videoStream->start_time : 0;
+    int64_t target = startTime + av_rescale_q(frameNumber, av_inv_q(frameRate), videoStream->time_base);
+    int64_t halfFrame = av_rescale_q(1, av_inv_q(frameRate), videoStream->time_base) / 2;
+    return decodeFrameAt(formatContext, codecContext, videoStreamIndex, target - halfFrame, frame, nullptr);
+}
+
+int generateThumbnailAtFrame(const char* srcFilePath, long long frameNumber, const char* outputDirPath, const char* outputFileName, const char* outputFormat, int width, int height) {
+    CallScope scope;
+    AVFormatContext* formatContext = nullptr;
+    AVCodecContext* codecContext = nullptr;
+    AVFrame* frame = nullptr;
+    AVFrame* frameRGB = nullptr;
+    struct SwsContext* swsContext = nullptr;
+    KeyframeIndex keyframeIndex;
+    int videoStreamIndex = -1;
+    int ret = 0;
+
+    auto cleanup = [&]() {
+        unloadKeyframeIndex(&keyframeIndex);
+        sws_freeContext(swsContext);
+        releaseFrame(&frame);
+        releaseFrame(&frameRGB);
+        avcodec_free_context(&codecContext);
+        closeInput(&formatContext);
+    };
+
+    if (frameNumber < 0) {
+        return -1; // Invalid frame number
+    }
+
+    // Open input file and its video decoder
+    enterPhase(MEDIA_PHASE_OPEN);
+    if (avformat_open_input(&formatContext, srcFilePath, nullptr, nullptr) != 0) {
+        return -1; // Couldn't open file
+    }
+    enterPhase(MEDIA_PHASE_PROBE);
+    if (avformat_find_stream_info(formatContext, nullptr) < 0 || openVideoDecoder(formatContext, &videoStreamIndex, &codecContext) < 0) {
+        cleanup();
+        return -1; // No decodable video stream
+    }
+
+    // A frame number maps to a time only at a constant frame rate. The rate fields alone don't show
+    // that reliably, so the frame count must also agree with duration times rate; anything else
+    // needs the index. Build the sidecar (a packet scan, no decoding) the first time such a file is
+    // asked for, or scan into memory when it can't be written.
+    AVStream* videoStream = formatContext->streams[videoStreamIndex];
+    double streamDuration = videoStream->duration != AV_NOPTS_VALUE ? double(videoStream->duration) * av_q2d(videoStream->time_base) : -1;
+    bool constantFrameRate = av_cmp_q(videoStream->r_frame_rate, videoStream->avg_frame_rate) == 0 && videoStream->avg_frame_rate.num > 0 &&
+                             videoStream->nb_frames > 0 && streamDuration > 0 &&
+                             std::fabs(double(videoStream->nb_frames) - streamDuration * av_q2d(videoStream->avg_frame_rate)) <= 1;
+    if (!loadKeyframeIndex(srcFilePath, &keyframeIndex) && !constantFrameRate) {
+        if (!(buildKeyframeIndex(srcFilePath) && loadKeyframeIndex(srcFilePath, &keyframeIndex)) &&
+            !scanKeyframeIndex(formatContext, videoStreamIndex, &keyframeIndex)) {
+            cleanup();
+            return -1; // No way to number the frames
+        }
+    }
+
+    frame = acquireFrame();
+    frameRGB = acquireFrame();
+    if (!frame || !frameRGB || allocPooledImage(frameRGB, AV_PIX_FMT_RGB24, width, height) < 0) {
+        cleanup();
+        return -1; // Could not allocate frame
+    }
+
+    if (decodeFrameNumber(formatContext, codecContext, videoStreamIndex, frameNumber, frame, &keyframeIndex) < 0) {
+        cleanup();
+        return -1; // Frame not found
+    }
+
+    // Convert the image from its native format to RGB
+    enterPhase(MEDIA_PHASE_SCALE);
+    swsContext = sws_getContext(frame->width, frame->height, (enum AVPixelFormat)frame->format, width, height, AV_PIX_FMT_RGB24, SWS_BILINEAR, nullptr, nullptr, nullptr);
+    if (!swsContext) {
+        cleanup();
+        return -1; // Could not initialize SWS context
+    }
+    sws_scale(swsContext, (uint8_t const* const*)frame->data, frame->linesize, 0, frame->height, frameRGB->data, frameRGB->linesize);
+
+    // Construct thumbnail file path and save as JPEG
+    char thumbnailFilePath[1024];
+    snprintf(thumbnailFilePath, sizeof(thumbnailFilePath), "%s/%s.%s", outputDirPath, outputFileName, outputFormat);
+    enterPhase(MEDIA_PHASE_WRITE);
+    if (strcmp(outputFormat, "jpeg") == 0 || strcmp(outputFormat, "jpg") == 0) {
+        if (saveAsJPEG(thumbnailFilePath, frameRGB->data[0], width, height, frameRGB->linesize[0]) == 0) {
+            ret = 1; // Success
+        }
+    }
+
+    cleanup();
+    return ret;
+}
+
+// Audio decoding shared by the audio analysis functions: the first audio stream, every other stream
+// discarded in the demuxer, converted by swresample to one fixed format, rate and channel layout
+struct AudioReader {
+    AVFormatContext* formatContext = nullptr;
+    AVCodecContext* codecContext = nullptr;
+    SwrContext* resampler = nullptr;
+    int streamIndex = -1;
+    enum AVSampleFormat format = AV_SAMPLE_FMT_NONE;
+    int sampleRate = 0;
+    AVChannelLayout layout{};
+    uint8_t** buffer = nullptr; // Conversion output, reused for every frame and grown as needed
+    int bufferSamples = 0;
+};
+
+static void closeAudioReader(AudioReader* reader) {
+    if (reader->buffer) {
+        av_freep(&reader->buffer[0]);
+        av_freep(&reader->buffer);
+    }
+    swr_free(&reader->resampler);
+    avcodec_free_context(&reader->codecContext);
+    closeInput(&reader->formatContext);
+    av_channel_layout_uninit(&reader->layout);
+}
+
+// Open the first audio stream of srcFilePath to read as format (AV_SAMPLE_FMT_NONE keeps the
+// decoder's) at sampleRate (0 keeps the source rate) in layout (nullptr keeps the source layout)
+static int openAudioReader(AudioReader* reader, const char* srcFilePath, enum AVSampleFormat format, int sampleRate, const AVChannelLayout* layout) {
+    enterPhase(MEDIA_PHASE_OPEN);
+    if (avformat_open_input(&reader->formatContext, srcFilePath, nullptr, nullptr) != 0) {
+        return -1; // Couldn't open file
+    }
+    AVFormatContext* formatContext = reader->formatContext;
+    enterPhase(MEDIA_PHASE_PROBE);
+    if (avformat_find_stream_info(formatContext, nullptr) < 0) {
+        return -1; // Couldn't find stream information
+    }
+
+    // Find the first audio stream and skip everything else
+    for (unsigned int i = 0; i < formatContext->nb_streams; ++i) {
+        if (reader->streamIndex == -1 && formatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+            reader->streamIndex = int(i);
+        } else {
+            formatContext->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+    if (reader->streamIndex == -1) {
+        return -1; // Didn't find an audio stream
+    }
+
+    enterPhase(MEDIA_PHASE_CODEC_OPEN);
+    AVStream* stream = formatContext->streams[reader->streamIndex];
+    const AVCodec* codec = avcodec_find_decoder(stream->codecpar->codec_id);
+    if (!codec) {
+        return -1; // Codec not found
+    }
+    reader->codecContext = avcodec_alloc_context3(codec);
+    if (!reader->codecContext || avcodec_parameters_to_context(reader->codecContext, stream->codecpar) < 0) {
+        return -1; // Could not set up codec context
+    }
+    reader->codecContext->pkt_timebase = stream->time_base;
+    if (avcodec_open2(reader->codecContext, codec, nullptr) < 0) {
+        return -1; // Could not open codec
+    }
+
+    // Some demuxers leave the layout unspecified; assume the default one for the channel count
+    AVCodecContext* codecContext = reader->codecContext;
+    AVChannelLayout sourceLayout{};
+    if (codecContext->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC) {
+        av_channel_layout_default(&sourceLayout, codecContext->ch_layout.nb_channels);
+    } else {
+        av_channel_layout_copy(&sourceLayout, &codecContext->ch_layout);
+    }
+    reader->format = format != AV_SAMPLE_FMT_NONE ? format : codecContext->sample_fmt;
+    reader->sampleRate = sampleRate > 0 ? sampleRate : codecContext->sample_rate;
+    int ret = av_channel_layout_copy(&reader->layout, layout ? layout : &sourceLayout);
+    if (ret >= 0) {
+        ret = swr_alloc_set_opts2(&reader->resampler, &reader->layout, reader->format, reader->sampleRate, &sourceLayout, codecContext->sample_fmt, codecContext->sample_rate, 0, nullptr);
+    }
+    av_channel_layout_uninit(&sourceLayout);
+    if (ret < 0 || swr_init(reader->resampler) < 0) {
+        return -1; // Could not set up the resampler
+    }
+    reader->buffer = static_cast<uint8_t**>(av_mallocz(sizeof(uint8_t*) * size_t(reader->layout.nb_channels)));
+    return reader->buffer ? 0 : -1;
+}
+
+// Convert samples (nullptr flushes the resampler) and pass the result on. Time spent in consume
+// belongs to no phase; decoding resumes afterwards.
+static int convertAudio(AudioReader* reader, const uint8_t* const* samples, int numSamples, const std::function<int(uint8_t* const*, int)>& consume) {
+    int capacity = swr_get_out_samples(reader->resampler, numSamples);
+    if (capacity <= 0) {
+        return 0;
+    }
+    if (capacity > reader->bufferSamples) {
+        av_freep(&reader->buffer[0]);
+        reader->bufferSamples = 0;
+        if (av_samples_alloc(reader->buffer, nullptr, reader->layout.nb_channels, capacity, reader->format, 0) < 0) {
+            return AVERROR(ENOMEM);
+        }
+        reader->bufferSamples = capacity;
+    }
+    enterPhase(MEDIA_PHASE_SCALE);
+    int converted = swr_convert(reader->resampler, reader->buffer, capacity, (const uint8_t**)samples, numSamples);
+    if (converted <= 0) {
+        enterPhase(MEDIA_PHASE_DECODE);
+        return converted;
+    }
+    enterPhase(MEDIA_PHASE_NONE);
+    int ret = consume(reader->buffer, converted);
+    enterPhase(MEDIA_PHASE_DECODE);
+    return ret;
+}
+
+// Decode to the end of the stream, passing each converted chunk to consume (one pointer per plane,
+// so a single one for interleaved formats). Stops early when consume returns < 0 or guard trips.
+static int readAudio(AudioReader* reader, const std::function<int(uint8_t* const*, int)>& consume, const CallGuard* guard = nullptr) {
+    AVPacket* packet = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    if (!packet || !frame) {
+        av_packet_free(&packet);
+        av_frame_free(&frame);
+        return AVERROR(ENOMEM);
+    }
+
+    enterPhase(MEDIA_PHASE_DECODE);
+    int ret = 0;
+    bool draining = false;
+    while (ret >= 0 && !draining) {
+        if (guard && guard->stopped()) {
+            ret = AVERROR_EXIT;
+            break;
+        }
+        if (av_read_frame(reader->formatContext, packet) < 0) {
+            draining = true;
+            avcodec_send_packet(reader->codecContext, nullptr);
+        } else if (packet->stream_index == reader->streamIndex) {
+            // A packet the decoder rejects is skipped; the rest of the stream is still usable
+            avcodec_send_packet(reader->codecContext, packet);
+            av_packet_unref(packet);
+        } else {
+            av_packet_unref(packet);
+            continue;
+        }
+        while (ret >= 0 && avcodec_receive_frame(reader->codecContext, frame) == 0) {
+            countDecodedFrame();
+            ret = convertAudio(reader, frame->extended_data, frame->nb_samples, consume);
+            av_frame_unref(frame);
+        }
+    }
+    if (ret >= 0) {
+        ret = convertAudio(reader, nullptr, 0, consume);
+    }
+
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    return ret;
+}
+
+// Minimum and maximum of count samples, folded into *minimum and *maximum. Eight samples per step
+// in two vector accumulators where SSE2 or NEON is available, with a scalar tail.
+static void minMaxSamples(const float* samples, int count, float* minimum, float* maximum) {
+    float lo = *minimum;
+    float hi = *maximum;
+    int i = 0;
+#if defined(__SSE2__)
+    if (count >= 8) {
+        __m128 lo0 = _mm_set1_ps(lo), lo1 = lo0, hi0 = _mm_set1_ps(hi), hi1 = hi0;
+        for (; i + 8 <= count; i += 8) {
+            __m128 a = _mm_loadu_ps(samples + i);
+            __m128 b = _mm_loadu_ps(samples + i + 4);
+            lo0 = _mm_min_ps(lo0, a);
+            hi0 = _mm_max_ps(hi0, a);
+            lo1 = _mm_min_ps(lo1, b);
+            hi1 = _mm_max_ps(hi1, b);
+        }
+        float lanes[8];
+        _mm_storeu_ps(lanes, _mm_min_ps(lo0, lo1));
+        _mm_storeu_ps(lanes + 4, _mm_max_ps(hi0, hi1));
+        lo = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+        hi = std::max(std::max(lanes[4], lanes[5]), std::max(lanes[6], lanes[7]));
+    }
+#elif defined(__ARM_NEON)
+    if (count >= 8) {
+        float32x4_t lo0 = vdupq_n_f32(lo), lo1 = lo0, hi0 = vdupq_n_f32(hi), hi1 = hi0;
+        for (; i + 8 <= count; i += 8) {
+            float32x4_t a = vld1q_f32(samples + i);
+            float32x4_t b = vld1q_f32(samples + i + 4);
+            lo0 = vminq_f32(lo0, a);
+            hi0 = vmaxq_f32(hi0, a);
+            lo1 = vminq_f32(lo1, b);
+            hi1 = vmaxq_f32(hi1, b);
+        }
+        float lanes[8];
+        vst1q_f32(lanes, vminq_f32(lo0, lo1));
+        vst1q_f32(lanes + 4, vmaxq_f32(hi0, hi1));
+        lo = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+        hi = std::max(std::max(lanes[4], lanes[5]), std::max(lanes[6], lanes[7]));
+    }
+#endif
+    for (; i < count; ++i) {
+        lo = std::min(lo, samples[i]);
+        hi = std::max(hi, samples[i]);
+    }
+    *minimum = lo;
+    *maximum = hi;
+}
+
+// Waveform peaks file: a header, then per zoom level its samples per pixel, its length in pixels
+// and length (min, max) pairs of 16-bit samples. Each level halves the one before it.
+struct WaveformHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t sampleRate;
+    uint32_t numLevels;
+};
+
+struct WaveformLevelHeader {
+    uint32_t samplesPerPixel;
+    uint32_t length;
+};
+
+static const char waveformMagic[4] = {'M', 'L', 'W', 'F'};
+static const uint32_t waveformVersion = 1;
+static const size_t waveformMaxLevels = 8;
+
+struct WaveformLevel {
+    int samplesPerPixel;
+    std::vector<int16_t> peaks; // min, max per pixel
+};
+
+static int16_t waveformSample(float value) {
+    return int16_t(std::max(-32768.0f, std::min(32767.0f, value * 32767.0f)));
+}
+
+static bool writeWaveformBinary(FILE* file, int sampleRate, const std::vector<WaveformLevel>& levels) {
+    WaveformHeader header{};
+    memcpy(header.magic, waveformMagic, sizeof(header.magic));
+    header.version = waveformVersion;
+    header.sampleRate = uint32_t(sampleRate);
+    header.numLevels = uint32_t(levels.size());
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (const WaveformLevel& level : levels) {
+        WaveformLevelHeader levelHeader{uint32_t(level.samplesPerPixel), uint32_t(level.peaks.size() / 2)};
+        ok = ok && fwrite(&levelHeader, sizeof(levelHeader), 1, file) == 1;
+        ok = ok && fwrite(level.peaks.data(), sizeof(int16_t), level.peaks.size(), file) == level.peaks.size();
+    }
+    return ok;
+}
+
+static bool writeWaveformJSON(FILE* file, int sampleRate, const std::vector<WaveformLevel>& levels) {
+    fprintf(file, "{\"version\":%u,\"sample_rate\":%d,\"levels\":[", waveformVersion, sampleRate);
+    for (size_t i = 0; i < levels.size(); ++i) {
+        fprintf(file, "%s{\"samples_per_pixel\":%d,\"length\":%zu,\"data\":[", i ? "," : "", levels[i].samplesPerPixel, levels[i].peaks.size() / 2);
+        for (size_t j = 0; j < levels[i].peaks.size(); ++j) {
+            fprintf(file, j ? ",%d" : "%d", levels[i].peaks[j]);
+        }
+        fputs("]}", file);
+    }
+    fputs("]}\n", file);
+    return ferror(file) == 0;
+}
+
+int generateWaveform(const char* srcFilePath, int samplesPerPixel, const char* outputPath) {
+    CallScope scope;
+    if (samplesPerPixel <= 0) {
+        return 0; // Invalid zoom
     }
 
-    // Allocate codec context
-    codecContext = avcodec_alloc_context3(codec);
-    if (!codecContext) {
-        avformat_close_input(&formatContext);
-        return thumbnails; // Could not allocate codec context
+    // Decode as mono float; swresample does the downmix
+    AudioReader reader;
+    AVChannelLayout mono{};
+    av_channel_layout_default(&mono, 1);
+    if (openAudioReader(&reader, srcFilePath, AV_SAMPLE_FMT_FLT, 0, &mono) < 0) {
+        closeAudioReader(&reader);
+        return 0;
     }
 
-    // Copy codec parameters to codec context
-    if (avcodec_parameters_to_context(codecContext, codecParameters) < 0) {
-        avcodec_free_context(&codecContext);
-        avformat_close_input(&formatContext);
-        return thumbnails; // Could not copy codec parameters
+    // One streaming pass builds the finest level
+    std::vector<WaveformLevel> levels(1);
+    levels[0].samplesPerPixel = samplesPerPixel;
+    float lo = std::numeric_limits<float>::max();
+    float hi = std::numeric_limits<float>::lowest();
+    int filled = 0;
+    auto flushPixel = [&]() {
+        levels[0].peaks.push_back(waveformSample(lo));
+        levels[0].peaks.push_back(waveformSample(hi));
+        lo = std::numeric_limits<float>::max();
+        hi = std::numeric_limits<float>::lowest();
+        filled = 0;
+    };
+    int ret = readAudio(&reader, [&](uint8_t* const* data, int numSamples) {
+        const auto* samples = reinterpret_cast<const float*>(data[0]);
+        while (numSamples > 0) {
+            int count = std::min(numSamples, samplesPerPixel - filled);
+            minMaxSamples(samples, count, &lo, &hi);
+            samples += count;
+            numSamples -= count;
+            filled += count;
+            if (filled == samplesPerPixel) {
+                flushPixel();
+            }
+        }
+        return 0;
+    });
+    if (filled > 0) {
+        flushPixel();
+    }
+    int sampleRate = reader.sampleRate;
+    closeAudioReader(&reader);
+    if (ret < 0 || levels[0].peaks.empty()) {
+        return 0; // Decoding failed or no audio
     }
 
-    // Open codec
-    if (avcodec_open2(codecContext, codec, nullptr) < 0) {
-        avcodec_free_context(&codecContext);
-        avformat_close_input(&formatContext);
-        return thumbnails; // Could not open codec
+    // Coarser levels merge pairs of pixels from the level below
+    while (levels.size() < waveformMaxLevels && levels.back().peaks.size() > 2) {
+        const WaveformLevel& finer = levels.back();
+        WaveformLevel coarser;
+        coarser.samplesPerPixel = finer.samplesPerPixel * 2;
+        coarser.peaks.reserve(finer.peaks.size() / 2 + 2);
+        for (size_t i = 0; i < finer.peaks.size(); i += 4) {
+            bool pair = i + 2 < finer.peaks.size();
+            coarser.peaks.push_back(pair ? std::min(finer.peaks[i], finer.peaks[i + 2]) : finer.peaks[i]);
+            coarser.peaks.push_back(pair ? std::max(finer.peaks[i + 1], finer.peaks[i + 3]) : finer.peaks[i + 1]);
+        }
+        levels.push_back(std::move(coarser));
     }
 
-    // Allocate frames
-    frame = av_frame_alloc();
-    frameRGB = av_frame_alloc();
-    if (!frame || !frameRGB) {
-        avcodec_free_context(&codecContext);
-        avformat_close_input(&formatContext);
-        return thumbnails; // Could not allocate frame
+    // JSON when the output is named .json, the binary peaks format otherwise
+    size_t pathLength = strlen(outputPath);
+    bool json = pathLength >= 5 && strcmp(outputPath + pathLength - 5, ".json") == 0;
+    enterPhase(MEDIA_PHASE_WRITE);
+    FILE* file = fopen(outputPath, "wb");
+    if (!file) {
+        return 0; // Couldn't create output file
     }
+    bool ok = json ? writeWaveformJSON(file, sampleRate, levels) : writeWaveformBinary(file, sampleRate, levels);
+    return fclose(file) == 0 && ok ? 1 : 0;
+}
 
-    // Allocate buffer for RGB frame
-    int numBytes = av_image_get_buffer_size(AV_PIX_FMT_RGB24, width, height, 1);
-    auto* buffer = (uint8_t*)av_malloc(numBytes * sizeof(uint8_t));
-    if (!buffer) {
-        av_frame_free(&frame);
-        av_frame_free(&frameRGB);
-        avcodec_free_context(&codecContext);
-        avformat_close_input(&formatContext);
-        return thumbnails; // Could not allocate buffer
+// EBU R128 / ITU-R BS.1770-4 loudness in one pass and constant memory. K-weighting runs as two
+// cascaded biquads in double precision with a pair of channels per SIMD lane pair. Gating works on
+// 100 ms sub-block energies kept in a 3 s ring, and 0.1 LU histograms stand in for the lists of
+// gating blocks, so memory doesn't grow with the input.
+#if defined(__SSE2__)
+typedef __m128d ChannelPair;
+static inline ChannelPair pairSet(double first, double second) { return _mm_set_pd(second, first); }
+static inline ChannelPair pairSplat(double value) { return _mm_set1_pd(value); }
+static inline ChannelPair pairAdd(ChannelPair a, ChannelPair b) { return _mm_add_pd(a, b); }
+static inline ChannelPair pairSub(ChannelPair a, ChannelPair b) { return _mm_sub_pd(a, b); }
+static inline ChannelPair pairMul(ChannelPair a, ChannelPair b) { return _mm_mul_pd(a, b); }
+static inline void pairStore(double* out, ChannelPair a) { _mm_storeu_pd(out, a); }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+typedef float64x2_t ChannelPair;
+static inline ChannelPair pairSet(double first, double second) { return vsetq_lane_f64(second, vdupq_n_f64(first), 1); }
+static inline ChannelPair pairSplat(double value) { return vdupq_n_f64(value); }
+static inline ChannelPair pairAdd(ChannelPair a, ChannelPair b) { return vaddq_f64(a, b); }
+static inline ChannelPair pairSub(ChannelPair a, ChannelPair b) { return vsubq_f64(a, b); }
+static inline ChannelPair pairMul(ChannelPair a, ChannelPair b) { return vmulq_f64(a, b); }
+static inline void pairStore(double* out, ChannelPair a) { vst1q_f64(out, a); }
+#else
+struct ChannelPair {
+    double first, second;
+};
+static inline ChannelPair pairSet(double first, double second) { return {first, second}; }
+static inline ChannelPair pairSplat(double value) { return {value, value}; }
+static inline ChannelPair pairAdd(ChannelPair a, ChannelPair b) { return {a.first + b.first, a.second + b.second}; }
+static inline ChannelPair pairSub(ChannelPair a, ChannelPair b) { return {a.first - b.first, a.second - b.second}; }
+static inline ChannelPair pairMul(ChannelPair a, ChannelPair b) { return {a.first * b.first, a.second * b.second}; }
+static inline void pairStore(double* out, ChannelPair a) { out[0] = a.first; out[1] = a.second; }
+#endif
+
+struct Biquad {
+    double b0, b1, b2, a1, a2;
+};
+
+// Transposed direct form II state for one biquad over a pair of channels
+struct PairBiquadState {
+    ChannelPair z1 = pairSplat(0);
+    ChannelPair z2 = pairSplat(0);
+};
+
+static inline ChannelPair runBiquad(const Biquad& filter, PairBiquadState* state, ChannelPair x) {
+    ChannelPair y = pairAdd(pairMul(pairSplat(filter.b0), x), state->z1);
+    state->z1 = pairAdd(pairSub(pairMul(pairSplat(filter.b1), x), pairMul(pairSplat(filter.a1), y)), state->z2);
+    state->z2 = pairSub(pairMul(pairSplat(filter.b2), x), pairMul(pairSplat(filter.a2), y));
+    return y;
+}
+
+// BS.1770 K-weighting (the high shelf, then the RLB high-pass), derived for any sample rate from the
+// analog prototypes of the 48 kHz coefficients in the standard
+static void kWeightingFilters(int sampleRate, Biquad* shelf, Biquad* highPass) {
+    double k = tan(M_PI * 1681.974450955533 / sampleRate);
+    double q = 0.7071752369554196;
+    double vh = pow(10.0, 3.999843853973347 / 20.0);
+    double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    *shelf = {(vh + vb * k / q + k * k) / a0, 2.0 * (k * k - vh) / a0, (vh - vb * k / q + k * k) / a0, 2.0 * (k * k - 1.0) / a0, (1.0 - k / q + k * k) / a0};
+
+    k = tan(M_PI * 38.13547087602444 / sampleRate);
+    q = 0.5003270373238773;
+    a0 = 1.0 + k / q + k * k;
+    *highPass = {1.0, -2.0, 1.0, 2.0 * (k * k - 1.0) / a0, (1.0 - k / q + k * k) / a0};
+}
+
+// Surround channels count 1.41 times (+1.5 dB), LFE not at all
+static double loudnessChannelWeight(enum AVChannel channel) {
+    switch (channel) {
+        case AV_CHAN_LOW_FREQUENCY:
+        case AV_CHAN_LOW_FREQUENCY_2: return 0.0;
+        case AV_CHAN_SIDE_LEFT:
+        case AV_CHAN_SIDE_RIGHT:
+        case AV_CHAN_BACK_LEFT:
+        case AV_CHAN_BACK_RIGHT: return 1.41;
+        default: return 1.0;
     }
+}
 
-    // Set up the frameRGB with the buffer
-    av_image_fill_arrays(frameRGB->data, frameRGB->linesize, buffer, AV_PIX_FMT_RGB24, width, height, 1);
+static double energyToLoudness(double energy) {
+    return energy > 0 ? -0.691 + 10.0 * log10(energy) : -HUGE_VAL;
+}
 
-    // Initialize SWS context for software scaling
-    swsContext = sws_getContext(codecContext->width, codecContext->height, codecContext->pix_fmt, width, height, AV_PIX_FMT_RGB24, SWS_BILINEAR, nullptr, nullptr, nullptr);
-    if (!swsContext) {
-        av_free(buffer);
-        av_frame_free(&frame);
-        av_frame_free(&frameRGB);
-        avcodec_free_context(&codecContext);
-        avformat_close_input(&formatContext);
-        return thumbnails; // Could not initialize SWS context
+// 0.1 LU bins from -70 LUFS (the absolute gate) to +30 LUFS, with the energy in each bin
+struct LoudnessHistogram {
+    static constexpr int numBins = 1000;
+    std::vector<int64_t> counts = std::vector<int64_t>(numBins, 0);
+    std::vector<double> energies = std::vector<double>(numBins, 0.0);
+
+    static int bin(double loudness) {
+        return std::min(numBins - 1, int((loudness + 70.0) * 10.0));
     }
 
-    // Read frames and save thumbnails
-    int frameCount = 0;
-    while (av_read_frame(formatContext, &packet) >= 0 && frameCount < numThumbnails) {
-        if (packet.stream_index == videoStreamIndex) {
-            if (avcodec_send_packet(codecContext, &packet) == 0) {
-                if (avcodec_receive_frame(codecContext, frame) == 0) {
-                    // Convert the image from its native format to RGB
-                    sws_scale(swsContext, (uint8_t const* const*)frame->data, frame->linesize, 0, codecContext->height, frameRGB->data, frameRGB->linesize);
+    void add(double energy) {
+        double loudness = energyToLoudness(energy);
+        if (loudness >= -70.0) {
+            int index = bin(loudness);
+            counts[index] += 1;
+            energies[index] += energy;
+        }
+    }
 
-                    // Construct thumbnail file path
-                    char thumbnailFilePath[1024];
-                    snprintf(thumbnailFilePath, sizeof(thumbnailFilePath), "%s/thumbnail_%d.ppm", outputDirPath, frameCount);
+    // Loudness of everything at least gate LU below the ungated mean, and that bin
+    int relativeGateBin(double gate) const {
+        int64_t count = 0;
+        double energy = 0;
+        for (int i = 0; i < numBins; ++i) {
+            count += counts[i];
+            energy += energies[i];
+        }
+        return count > 0 ? std::max(0, bin(energyToLoudness(energy / double(count)) - gate)) : numBins;
+    }
+};
 
-                    // Save the frame to a file
-                    FILE* file = fopen(thumbnailFilePath, "wb");
-                    if (file) {
-                        fprintf(file, "P6\n%d %d\n255\n", width, height);
-                        for (int y = 0; y < height; y++) {
-                            fwrite(frameRGB->data[0] + y * frameRGB->linesize[0], 1, width * 3, file);
-                        }
-                        fclose(file);
-                        thumbnails[frameCount] = thumbnailFilePath;
-                        frameCount++;
+// True peak by 4x oversampling below 96 kHz through a windowed-sinc polyphase interpolator with 12
+// taps per phase. From 96 kHz up the samples are dense enough that the sample peak stands in for it.
+struct TruePeakMeter {
+    int factor = 1;
+    int taps = 1;
+    std::vector<double> coefficients;         // factor phases of taps coefficients each
+    std::vector<std::vector<float>> history;  // Per channel: the last taps - 1 samples, then the chunk
+    double truePeak = 0;
+    double samplePeak = 0;
+
+    void init(int sampleRate, int channels) {
+        factor = sampleRate < 96000 ? 4 : 1;
+        taps = factor > 1 ? 12 : 1;
+        int length = factor * taps;
+        coefficients.assign(size_t(length), 1.0);
+        for (int m = 0; factor > 1 && m < length; ++m) {
+            double t = (m - (length - 1) / 2.0) / factor;
+            double sinc = t == 0 ? 1.0 : sin(M_PI * t) / (M_PI * t);
+            double window = 0.42 - 0.5 * cos(2 * M_PI * m / (length - 1)) + 0.08 * cos(4 * M_PI * m / (length - 1));
+            coefficients[size_t(m)] = sinc * window;
+        }
+        history.assign(size_t(channels), std::vector<float>(size_t(taps - 1), 0.0f));
+    }
+
+    void add(int channel, const float* samples, int numSamples) {
+        std::vector<float>& buffer = history[size_t(channel)];
+        buffer.insert(buffer.end(), samples, samples + numSamples);
+        for (int i = 0; i < numSamples; ++i) {
+            const float* window = buffer.data() + i; // window[taps - 1] is the current sample
+            samplePeak = std::max(samplePeak, double(std::fabs(window[taps - 1])));
+            for (int phase = 0; phase < factor; ++phase) {
+                double sum = 0;
+                for (int k = 0; k < taps; ++k) {
+                    sum += coefficients[size_t(phase + factor * k)] * window[taps - 1 - k];
+                }
+                truePeak = std::max(truePeak, std::fabs(sum));
+            }
+        }
+        buffer.erase(buffer.begin(), buffer.end() - (taps - 1));
+    }
+};
+
+struct LoudnessMeter {
+    int channels = 0;
+    int subBlockSamples = 0;                  // 100 ms
+    std::vector<double> weights;
+    Biquad shelf{}, highPass{};
+    std::vector<PairBiquadState> shelfStates, highPassStates;
+    std::vector<double> channelEnergy;        // Sums of squares in the current sub-block
+    int filled = 0;
+    double subBlocks[30] = {};                // Ring of the last 3 s of sub-block energies
+    int64_t numSubBlocks = 0;
+    LoudnessHistogram momentary;              // 400 ms blocks every 100 ms, for integrated loudness
+    LoudnessHistogram shortTerm;              // 3 s blocks every 100 ms, for loudness range
+    TruePeakMeter peak;
+
+    void init(int sampleRate, const AVChannelLayout* layout) {
+        channels = layout->nb_channels;
+        subBlockSamples = std::max(1, sampleRate / 10);
+        kWeightingFilters(sampleRate, &shelf, &highPass);
+        weights.resize(size_t(channels));
+        for (int c = 0; c < channels; ++c) {
+            weights[size_t(c)] = loudnessChannelWeight(av_channel_layout_channel_from_index(layout, unsigned(c)));
+        }
+        shelfStates.resize(size_t(channels + 1) / 2);
+        highPassStates.resize(size_t(channels + 1) / 2);
+        channelEnergy.assign(size_t(channels + 1), 0.0);
+        peak.init(sampleRate, channels);
+    }
+
+    void finishSubBlock() {
+        double energy = 0;
+        for (int c = 0; c < channels; ++c) {
+            energy += weights[size_t(c)] * channelEnergy[size_t(c)] / subBlockSamples;
+        }
+        std::fill(channelEnergy.begin(), channelEnergy.end(), 0.0);
+        filled = 0;
+        subBlocks[numSubBlocks % 30] = energy;
+        ++numSubBlocks;
+
+        double sum = 0;
+        for (int64_t i = 1; i <= std::min<int64_t>(numSubBlocks, 30); ++i) {
+            sum += subBlocks[(numSubBlocks - i) % 30];
+            if (i == 4) {
+                momentary.add(sum / 4);
+            }
+        }
+        if (numSubBlocks >= 30) {
+            shortTerm.add(sum / 30);
+        }
+    }
+
+    // K-weight and accumulate planar samples, a pair of channels at a time
+    void add(const float* const* planes, int numSamples) {
+        for (int c = 0; c < channels; ++c) {
+            peak.add(c, planes[c], numSamples);
+        }
+        int offset = 0;
+        while (offset < numSamples) {
+            int count = std::min(numSamples - offset, subBlockSamples - filled);
+            for (int c = 0; c < channels; c += 2) {
+                const float* first = planes[c] + offset;
+                const float* second = c + 1 < channels ? planes[c + 1] + offset : nullptr;
+                PairBiquadState* shelfState = &shelfStates[size_t(c / 2)];
+                PairBiquadState* highPassState = &highPassStates[size_t(c / 2)];
+                ChannelPair sum = pairSplat(0);
+                for (int i = 0; i < count; ++i) {
+                    ChannelPair x = pairSet(first[i], second ? second[i] : 0.0f);
+                    ChannelPair y = runBiquad(highPass, highPassState, runBiquad(shelf, shelfState, x));
+                    sum = pairAdd(sum, pairMul(y, y));
+                }
+                double sums[2];
+                pairStore(sums, sum);
+                channelEnergy[size_t(c)] += sums[0];
+                channelEnergy[size_t(c) + 1] += sums[1];
+            }
+            offset += count;
+            filled += count;
+            if (filled == subBlockSamples) {
+                finishSubBlock();
+            }
+        }
+    }
+
+    void result(LoudnessResult* out) const {
+        // Integrated: mean of the momentary blocks above -70 LUFS and within 10 LU of their mean
+        int64_t count = 0;
+        double energy = 0;
+        for (int i = momentary.relativeGateBin(10.0); i < LoudnessHistogram::numBins; ++i) {
+            count += momentary.counts[size_t(i)];
+            energy += momentary.energies[size_t(i)];
+        }
+        out->integratedLoudness = count > 0 ? energyToLoudness(energy / double(count)) : -HUGE_VAL;
+
+        // Range: 10th to 95th percentile of the short-term values within 20 LU of their mean
+        int gate = shortTerm.relativeGateBin(20.0);
+        int64_t gated = 0;
+        for (int i = gate; i < LoudnessHistogram::numBins; ++i) {
+            gated += shortTerm.counts[size_t(i)];
+        }
+        int64_t lowRank = int64_t(0.10 * double(gated - 1));
+        int64_t highRank = int64_t(0.95 * double(gated - 1));
+        double low = 0, high = 0;
+        int64_t seen = 0;
+        for (int i = gate; i < LoudnessHistogram::numBins && gated > 0; ++i) {
+            double loudness = -70.0 + (i + 0.5) / 10.0; // Bin centre
+            if (seen <= lowRank && lowRank < seen + shortTerm.counts[size_t(i)]) {
+                low = loudness;
+            }
+            if (seen <= highRank && highRank < seen + shortTerm.counts[size_t(i)]) {
+                high = loudness;
+            }
+            seen += shortTerm.counts[size_t(i)];
+        }
+        out->loudnessRange = high - low;
+        // The interpolated phases need not pass exactly through the samples, so the sample peak bounds it
+        double truePeak = std::max(peak.truePeak, peak.samplePeak);
+        out->truePeak = truePeak > 0 ? 20.0 * log10(truePeak) : -HUGE_VAL;
+        out->samplePeak = peak.samplePeak > 0 ? 20.0 * log10(peak.samplePeak) : -HUGE_VAL;
+    }
+};
+
+int measureLoudness(const char* srcFilePath, LoudnessResult* result) {
+    CallScope scope;
+    if (!result) {
+        return 0; // Nowhere to put the result
+    }
+
+    // Planar float at the source rate and layout; the filters are derived for that rate
+    AudioReader reader;
+    if (openAudioReader(&reader, srcFilePath, AV_SAMPLE_FMT_FLTP, 0, nullptr) < 0) {
+        closeAudioReader(&reader);
+        return 0;
+    }
+    LoudnessMeter meter;
+    meter.init(reader.sampleRate, &reader.layout);
+    int ret = readAudio(&reader, [&meter](uint8_t* const* data, int numSamples) {
+        meter.add(reinterpret_cast<const float* const*>(data), numSamples);
+        return 0;
+    });
+    closeAudioReader(&reader);
+    if (ret < 0) {
+        return 0; // Decoding failed
+    }
+    meter.result(result);
+    return 1;
+}
+
+// Spectrogram colours from silent to loud: black through purple, red and orange to pale yellow
+static void spectrogramColor(double level, uint8_t* rgb) {
+    static const uint8_t stops[][3] = {{0, 0, 4}, {40, 11, 84}, {101, 21, 110}, {159, 42, 99}, {212, 72, 66}, {245, 125, 21}, {250, 193, 39}, {252, 255, 164}};
+    const int last = int(sizeof(stops) / sizeof(stops[0])) - 1;
+    double position = std::max(0.0, std::min(1.0, level)) * last;
+    int index = std::min(last - 1, int(position));
+    double t = position - index;
+    for (int c = 0; c < 3; ++c) {
+        rgb[c] = uint8_t(stops[index][c] + (stops[index + 1][c] - stops[index][c]) * t + 0.5);
+    }
+}
+
+// Writes a width x height JPEG of the downmixed audio: time left to right, frequency (linear, up to
+// Nyquist) bottom to top, -120..0 dBFS mapped onto the palette. One streaming pass: Hann-windowed
+// real FFTs (av_tx) every hop samples, power averaged per column; memory depends on the image size
+// and FFT length only.
+int generateSpectrogram(const char* srcFilePath, int width, int height, const char* outputPath) {
+    CallScope scope;
+    if (width <= 0 || height <= 0) {
+        return 0; // Invalid size
+    }
+
+    AudioReader reader;
+    AVChannelLayout mono{};
+    av_channel_layout_default(&mono, 1);
+    if (openAudioReader(&reader, srcFilePath, AV_SAMPLE_FMT_FLT, 0, &mono) < 0) {
+        closeAudioReader(&reader);
+        return 0;
+    }
+
+    // Columns are laid out over the whole input, so the length has to be known up front
+    double duration = reader.formatContext->duration != AV_NOPTS_VALUE ? double(reader.formatContext->duration) / AV_TIME_BASE : 0;
+    if (duration <= 0) {
+        duration = getMediaDurationExact(srcFilePath);
+    }
+    int64_t totalSamples = int64_t(duration * reader.sampleRate);
+    if (totalSamples <= 0) {
+        closeAudioReader(&reader);
+        return 0; // Unknown length
+    }
+
+    // At least two bins per row, overlapping windows when columns are shorter than one
+    int fftSize = 256;
+    while (fftSize < 2 * height && fftSize < 16384) {
+        fftSize *= 2;
+    }
+    int bins = fftSize / 2 + 1;
+    int64_t samplesPerColumn = std::max<int64_t>(1, (totalSamples + width - 1) / width);
+    int hop = int(std::min<int64_t>(fftSize, samplesPerColumn));
+
+    AVTXContext* tx = nullptr;
+    av_tx_fn transform = nullptr;
+    float scale = 1.0f;
+    auto* input = static_cast<float*>(av_malloc(sizeof(float) * size_t(fftSize + 2)));
+    auto* output = static_cast<AVComplexFloat*>(av_malloc(sizeof(AVComplexFloat) * size_t(bins)));
+    if (!input || !output || av_tx_init(&tx, &transform, AV_TX_FLOAT_RDFT, 0, fftSize, &scale, 0) < 0) {
+        av_free(input);
+        av_free(output);
+        closeAudioReader(&reader);
+        return 0;
+    }
+
+    // Hann window, and the scale that puts a full-scale sine at 0 dB
+    std::vector<float> window(static_cast<size_t>(fftSize));
+    for (int i = 0; i < fftSize; ++i) {
+        window[size_t(i)] = float(0.5 - 0.5 * cos(2 * M_PI * i / fftSize));
+    }
+    double fullScale = double(fftSize) / 4.0;
+    double powerScale = 1.0 / (fullScale * fullScale);
+
+    std::vector<uint8_t> image(size_t(width) * size_t(height) * 3, 0);
+    std::vector<float> samples(size_t(fftSize), 0.0f); // Sliding window of the most recent samples
+    std::vector<double> power(size_t(bins), 0.0);      // Summed over the current column's transforms
+    int framesInColumn = 0;
+    int column = 0;
+    int64_t position = 0;  // Samples read so far
+    int sinceLast = 0;     // Samples read since the last transform
+
+    // Paint the finished column (or repeat the previous one when no transform fell in it)
+    auto finishColumn = [&]() {
+        uint8_t* pixel = image.data() + size_t(column) * 3;
+        for (int row = 0; row < height; ++row) {
+            uint8_t* rgb = pixel + size_t(height - 1 - row) * size_t(width) * 3;
+            if (framesInColumn == 0) {
+                if (column > 0) {
+                    memcpy(rgb, rgb - 3, 3);
+                }
+                continue;
+            }
+            int firstBin = int(int64_t(row) * bins / height);
+            int lastBin = std::max(firstBin + 1, int(int64_t(row + 1) * bins / height));
+            double peak = 0;
+            for (int bin = firstBin; bin < lastBin && bin < bins; ++bin) {
+                peak = std::max(peak, power[size_t(bin)]);
+            }
+            double db = 10.0 * log10(peak * powerScale / framesInColumn + 1e-20);
+            spectrogramColor((db + 120.0) / 120.0, rgb);
+        }
+        std::fill(power.begin(), power.end(), 0.0);
+        framesInColumn = 0;
+    };
+
+    int ret = readAudio(&reader, [&](uint8_t* const* data, int numSamples) {
+        const auto* chunk = reinterpret_cast<const float*>(data[0]);
+        while (numSamples > 0) {
+            int count = std::min(numSamples, hop - sinceLast);
+            memmove(samples.data(), samples.data() + count, sizeof(float) * size_t(fftSize - count));
+            memcpy(samples.data() + fftSize - count, chunk, sizeof(float) * size_t(count));
+            chunk += count;
+            numSamples -= count;
+            position += count;
+            sinceLast += count;
+            if (sinceLast < hop) {
+                continue;
+            }
+            sinceLast = 0;
+
+            // The transform belongs to the column holding its centre
+            int target = int(std::min<int64_t>(width - 1, std::max<int64_t>(0, position - fftSize / 2) / samplesPerColumn));
+            while (column < target) {
+                finishColumn();
+                ++column;
+            }
+            for (int i = 0; i < fftSize; ++i) {
+                input[i] = samples[size_t(i)] * window[size_t(i)];
+            }
+            transform(tx, output, input, sizeof(float));
+            for (int bin = 0; bin < bins; ++bin) {
+                power[size_t(bin)] += double(output[bin].re) * output[bin].re + double(output[bin].im) * output[bin].im;
+            }
+            ++framesInColumn;
+        }
+        return 0;
+    });
+    closeAudioReader(&reader);
+    av_tx_uninit(&tx);
+    av_free(input);
+    av_free(output);
+    if (ret < 0) {
+        return 0; // Decoding failed
+    }
+
+    // Finish the column in progress and fill any the audio ended short of
+    for (; column < width; ++column) {
+        finishColumn();
+    }
+    enterPhase(MEDIA_PHASE_WRITE);
+    return saveAsJPEG(outputPath, image.data(), width, height, width * 3) == 0 ? 1 : 0;
+}
+
+void initAudioDecodeOptions(AudioDecodeOptions* options) {
+    if (options) {
+        *options = AudioDecodeOptions{};
+        options->sampleFormat = MEDIA_FORMAT_KEEP;
+    }
+}
+
+long long decodeAudio(const char* srcFilePath, AudioCallback callback, void* user, const AudioDecodeOptions* options) {
+    CallScope scope;
+    if (!callback) {
+        return -1; // Nothing to deliver samples to
+    }
+    AudioDecodeOptions defaults;
+    initAudioDecodeOptions(&defaults);
+    const AudioDecodeOptions* opts = options ? options : &defaults;
+
+    // Open the first audio stream, converting to the requested rate, format and channel count
+    AudioReader reader;
+    AVChannelLayout layout{};
+    if (opts->channels > 0) {
+        av_channel_layout_default(&layout, opts->channels);
+    }
+    int opened = openAudioReader(&reader, srcFilePath, (enum AVSampleFormat)opts->sampleFormat, opts->sampleRate, opts->channels > 0 ? &layout : nullptr);
+    av_channel_layout_uninit(&layout);
+    if (opened < 0) {
+        closeAudioReader(&reader);
+        return -1; // No decodable audio stream
+    }
+    CallGuard guard = makeCallGuard(opts->control);
+    int channels = reader.layout.nb_channels;
+    int64_t duration = reader.formatContext->duration;
+
+    // Hand each chunk to the callback until it asks to stop
+    long long delivered = 0;
+    bool stop = false;
+    auto lastReport = std::chrono::steady_clock::now();
+    auto deliver = [&](uint8_t* const* data, int numSamples) {
+        MediaAudioChunk chunk{};
+        chunk.data = data;
+        chunk.numSamples = numSamples;
+        chunk.channels = channels;
+        chunk.sampleRate = reader.sampleRate;
+        chunk.sampleFormat = reader.format;
+        chunk.timestamp = double(delivered) / reader.sampleRate;
+        delivered += numSamples;
+        if (callback(&chunk, user) != 0) {
+            stop = true;
+            return AVERROR_EXIT;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (opts->control && opts->control->progress && duration > 0 && now - lastReport >= std::chrono::milliseconds(250)) {
+            lastReport = now;
+            opts->control->progress(std::min(1.0, double(delivered) / reader.sampleRate * AV_TIME_BASE / double(duration)), opts->control->user);
+        }
+        return 0;
+    };
+
+    int ret = 0;
+    if (opts->chunkSamples <= 0) {
+        ret = readAudio(&reader, deliver, &guard);
+    } else {
+        // Regroup into fixed-size chunks through a FIFO; the one chunk buffer is reused for every call
+        int chunkSamples = opts->chunkSamples;
+        AVAudioFifo* fifo = av_audio_fifo_alloc(reader.format, channels, chunkSamples * 2);
+        auto** chunkBuffer = static_cast<uint8_t**>(av_mallocz(sizeof(uint8_t*) * size_t(channels)));
+        if (!fifo || !chunkBuffer || av_samples_alloc(chunkBuffer, nullptr, channels, chunkSamples, reader.format, 0) < 0) {
+            ret = AVERROR(ENOMEM);
+        } else {
+            ret = readAudio(&reader, [&](uint8_t* const* data, int numSamples) {
+                if (av_audio_fifo_write(fifo, (void**)data, numSamples) < numSamples) {
+                    return AVERROR(ENOMEM);
+                }
+                while (av_audio_fifo_size(fifo) >= chunkSamples) {
+                    av_audio_fifo_read(fifo, (void**)chunkBuffer, chunkSamples);
+                    int delivering = deliver(chunkBuffer, chunkSamples);
+                    if (delivering < 0) {
+                        return delivering;
                     }
                 }
+                return 0;
+            }, &guard);
+            // Whatever is left makes a final, shorter chunkBuffer
+            if (ret >= 0 && av_audio_fifo_size(fifo) > 0) {
+                ret = deliver(chunkBuffer, av_audio_fifo_read(fifo, (void**)chunkBuffer, av_audio_fifo_size(fifo)));
             }
         }
-        av_packet_unref(&packet);
+        if (chunkBuffer) {
+            av_freep(&chunkBuffer[0]);
+            av_free(chunkBuffer);
+        }
+        if (fifo) {
+            av_audio_fifo_free(fifo);
+        }
     }
+    closeAudioReader(&reader);
+    return ret >= 0 || stop ? delivered : -1;
+}
 
-    // Free resources
-    sws_freeContext(swsContext);
-    av_free(buffer);
-    av_frame_free(&frame);
-    av_frame_free(&frameRGB);
-    avcodec_free_context(&codecContext);
-    avformat_close_input(&formatContext);
+// Sum of squares of count samples, eight per step in two vector accumulators where SSE2 or NEON
+// is available, with a scalar tail
+static double sumOfSquares(const float* samples, int count) {
+    double sum = 0;
+    int i = 0;
+#if defined(__SSE2__)
+    __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+    for (; i + 8 <= count; i += 8) {
+        __m128 a = _mm_loadu_ps(samples + i);
+        __m128 b = _mm_loadu_ps(samples + i + 4);
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(a, a));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(b, b));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(sum0, sum1));
+    sum = double(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__ARM_NEON)
+    float32x4_t sum0 = vdupq_n_f32(0), sum1 = vdupq_n_f32(0);
+    for (; i + 8 <= count; i += 8) {
+        float32x4_t a = vld1q_f32(samples + i);
+        float32x4_t b = vld1q_f32(samples + i + 4);
+        sum0 = vmlaq_f32(sum0, a, a);
+        sum1 = vmlaq_f32(sum1, b, b);
+    }
+    float lanes[4];
+    vst1q_f32(lanes, vaddq_f32(sum0, sum1));
+    sum = double(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+#endif
+    for (; i < count; ++i) {
+        sum += double(samples[i]) * samples[i];
+    }
+    return sum;
+}
 
-    return thumbnails;
+// Silence is judged over 10 ms windows of the downmixed audio: a window is silent when its RMS is
+// below thresholdDb (dBFS), and runs of silent windows at least minDuration seconds long are
+// reported. Returns the number of segments (*segments is then freed with releaseSilenceSegments),
+// or -1 on failure.
+int detectSilence(const char* srcFilePath, double thresholdDb, double minDuration, SilenceSegment** segments) {
+    CallScope scope;
+    if (!segments) {
+        return -1; // Nowhere to put the result
+    }
+    *segments = nullptr;
+
+    AudioReader reader;
+    AVChannelLayout mono{};
+    av_channel_layout_default(&mono, 1);
+    if (openAudioReader(&reader, srcFilePath, AV_SAMPLE_FMT_FLT, 0, &mono) < 0) {
+        closeAudioReader(&reader);
+        return -1;
+    }
+    int windowSamples = std::max(1, reader.sampleRate / 100);
+    double sampleRate = reader.sampleRate;
+
+    // Compare mean squares against the threshold rather than taking a log per window
+    double threshold = pow(10.0, thresholdDb / 10.0) * windowSamples;
+    std::vector<SilenceSegment> found;
+    int64_t position = 0;      // Samples read so far
+    int64_t silenceStart = -1; // Where the current run of silent windows began
+    double windowSum = 0;
+    int filled = 0;
+    auto endSilence = [&](int64_t end) {
+        if (silenceStart >= 0 && double(end - silenceStart) / sampleRate >= minDuration) {
+            found.push_back({double(silenceStart) / sampleRate, double(end) / sampleRate});
+        }
+        silenceStart = -1;
+    };
+    auto finishWindow = [&]() {
+        if (windowSum < threshold * filled / windowSamples) {
+            if (silenceStart < 0) {
+                silenceStart = position - filled;
+            }
+        } else {
+            endSilence(position - filled);
+        }
+        windowSum = 0;
+        filled = 0;
+    };
+    int ret = readAudio(&reader, [&](uint8_t* const* data, int numSamples) {
+        const auto* samples = reinterpret_cast<const float*>(data[0]);
+        while (numSamples > 0) {
+            int count = std::min(numSamples, windowSamples - filled);
+            windowSum += sumOfSquares(samples, count);
+            samples += count;
+            numSamples -= count;
+            filled += count;
+            position += count;
+            if (filled == windowSamples) {
+                finishWindow();
+            }
+        }
+        return 0;
+    });
+    closeAudioReader(&reader);
+    if (ret < 0) {
+        return -1; // Decoding failed
+    }
+    if (filled > 0) {
+        finishWindow();
+    }
+    endSilence(position);
+
+    if (!found.empty()) {
+        *segments = new SilenceSegment[found.size()];
+        std::copy(found.begin(), found.end(), *segments);
+    }
+    return int(found.size());
+}
+
+void releaseSilenceSegments(SilenceSegment* segments) {
+    delete[] segments;
+}
+
+// Asynchronous requests. Each runs its blocking counterpart as a scheduler task; the handle is
+// shared by the caller and the task, and freed once both have let go of it. Completion is
+// reported through the callback (on the worker thread), waitMediaRequest, or a pollable fd.
+struct MediaRequest {
+    std::atomic<int> references{2}; // The caller's handle and the running task
+    std::mutex mutex;
+    std::condition_variable done;
+    bool finished = false;
+    double result = 0;
+    MediaCallStats stats{};
+    bool haveStats = false;
+    MediaCancelToken cancelToken;
+    MediaRequestCallback callback = nullptr;
+    void* user = nullptr;
+    int readFd = -1;  // Created on the first getMediaRequestFd; the same fd as writeFd for eventfd
+    int writeFd = -1;
+};
+
+static void unrefMediaRequest(MediaRequest* request) {
+    if (request->references.fetch_sub(1) == 1) {
+        if (request->readFd >= 0) {
+            close(request->readFd);
+        }
+        if (request->writeFd >= 0 && request->writeFd != request->readFd) {
+            close(request->writeFd);
+        }
+        delete request;
+    }
+}
+
+// Make the request's fd readable; the caller holds request->mutex
+static void signalMediaRequest(MediaRequest* request) {
+    if (request->writeFd < 0) {
+        return;
+    }
+#if defined(__linux__)
+    uint64_t one = 1;
+    ssize_t written = write(request->writeFd, &one, sizeof(one));
+#else
+    char one = 1;
+    ssize_t written = write(request->writeFd, &one, 1);
+#endif
+    (void)written; // Already readable if it fails
+}
+
+// Run work on the scheduler; failed is the result when the request is cancelled before it starts
+static MediaRequest* startMediaRequest(std::function<double(MediaRequest*)> work, double failed, MediaRequestCallback callback, void* user) {
+    auto* request = new MediaRequest();
+    request->callback = callback;
+    request->user = user;
+    submitTask([request, work = std::move(work), failed]() {
+        haveLastCallStats = false; // Whatever ran on this worker before isn't this request's
+        double result = request->cancelToken.cancelled ? failed : work(request);
+        {
+            std::lock_guard<std::mutex> lock(request->mutex);
+            request->finished = true;
+            request->result = result;
+            request->haveStats = getLastCallStats(&request->stats) != 0;
+            signalMediaRequest(request);
+        }
+        request->done.notify_all();
+        if (request->callback) {
+            request->callback(request, request->user);
+        }
+        unrefMediaRequest(request);
+    });
+    return request;
+}
+
+MediaRequest* generateThumbnailAsync(const char* srcFilePath, const char* outputDirPath, const char* outputFileName, const char* outputFormat, int width, int height, MediaRequestCallback callback, void* user) {
+    if (!srcFilePath || !outputDirPath || !outputFileName || !outputFormat) {
+        return nullptr; // Missing path or format
+    }
+    std::string src = srcFilePath, dir = outputDirPath, name = outputFileName, format = outputFormat;
+    return startMediaRequest([=](MediaRequest*) {
+        return double(generateThumbnail(src.c_str(), dir.c_str(), name.c_str(), format.c_str(), width, height));
+    }, -1, callback, user);
+}
+
+MediaRequest* convertMediaFormatAsync(const char* srcFilePath, const char* destDirPath, const char* outputFileName, const char* outputFormat, const RemuxOptions* options, MediaRequestCallback callback, void* user) {
+    if (!srcFilePath || !destDirPath || !outputFileName || !outputFormat) {
+        return nullptr; // Missing path or format
+    }
+    std::string src = srcFilePath, dir = destDirPath, name = outputFileName, format = outputFormat;
+
+    // Keep a private copy of the options, including the stream list the caller may free; the
+    // caller's deadline applies, cancellation goes through the request
+    RemuxOptions copied{};
+    std::vector<int> streamIndices;
+    MediaCallControl control{};
+    if (options) {
+        copied = *options;
+        if (options->streamIndices && options->numStreamIndices > 0) {
+            streamIndices.assign(options->streamIndices, options->streamIndices + options->numStreamIndices);
+        }
+        if (options->control) {
+            control = *options->control;
+        }
+    }
+    control.progress = nullptr;
+    return startMediaRequest([=](MediaRequest* request) mutable {
+        control.cancelToken = &request->cancelToken;
+        copied.control = &control;
+        copied.streamIndices = streamIndices.empty() ? nullptr : streamIndices.data();
+        return double(convertMediaFormatWithOptions(src.c_str(), dir.c_str(), name.c_str(), format.c_str(), &copied));
+    }, 0, callback, user);
+}
+
+MediaRequest* getMediaDurationAsync(const char* filePath, MediaRequestCallback callback, void* user) {
+    if (!filePath) {
+        return nullptr; // Missing path
+    }
+    std::string path = filePath;
+    return startMediaRequest([=](MediaRequest*) { return getMediaDuration(path.c_str()); }, 0, callback, user);
+}
+
+MediaRequest* getMediaDurationExactAsync(const char* filePath, MediaRequestCallback callback, void* user) {
+    if (!filePath) {
+        return nullptr; // Missing path
+    }
+    std::string path = filePath;
+    return startMediaRequest([=](MediaRequest*) { return getMediaDurationExact(path.c_str()); }, 0, callback, user);
+}
+
+MediaRequest* isValidMediaFileAsync(const char* filePath, MediaRequestCallback callback, void* user) {
+    if (!filePath) {
+        return nullptr; // Missing path
+    }
+    std::string path = filePath;
+    return startMediaRequest([=](MediaRequest*) { return double(isValidMediaFile(path.c_str())); }, 0, callback, user);
+}
+
+int isMediaRequestDone(MediaRequest* request) {
+    std::lock_guard<std::mutex> lock(request->mutex);
+    return request->finished ? 1 : 0;
+}
+
+double waitMediaRequest(MediaRequest* request) {
+    std::unique_lock<std::mutex> lock(request->mutex);
+    request->done.wait(lock, [request]() { return request->finished; });
+    return request->result;
+}
+
+double getMediaRequestResult(MediaRequest* request) {
+    std::lock_guard<std::mutex> lock(request->mutex);
+    return request->result;
+}
+
+// A queued request is dropped when it comes up; a running conversion stops at its next packet
+void cancelMediaRequest(MediaRequest* request) {
+    request->cancelToken.cancelled = true;
+}
+
+int getMediaRequestFd(MediaRequest* request) {
+    std::lock_guard<std::mutex> lock(request->mutex);
+    if (request->readFd < 0) {
+#if defined(__linux__)
+        request->readFd = request->writeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+#else
+        int fds[2];
+        if (pipe(fds) == 0) {
+            fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+            fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+            fcntl(fds[0], F_SETFL, O_NONBLOCK);
+            fcntl(fds[1], F_SETFL, O_NONBLOCK);
+            request->readFd = fds[0];
+            request->writeFd = fds[1];
+        }
+#endif
+        if (request->finished) {
+            signalMediaRequest(request);
+        }
+    }
+    return request->readFd;
 }
 
+// The stats of the call a finished request ran; 0 while it's running or when it never started
+int getMediaRequestStats(MediaRequest* request, MediaCallStats* stats) {
+    std::lock_guard<std::mutex> lock(request->mutex);
+    if (!stats || !request->finished || !request->haveStats) {
+        return 0;
+    }
+    *stats = request->stats;
+    return 1;
+}
 
+void releaseMediaRequest(MediaRequest* request) {
+    if (request) {
+        unrefMediaRequest(request);
+    }
+}
@@ -1,15 +1,269 @@
 #ifndef MEDIA_LIBRARY_LIBRARY_H
 #define MEDIA_LIBRARY_LIBRARY_H
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef struct MediaFrame {
+    const uint8_t* data[4];
+    int linesize[4];
+    int width;
+    int height;
+    int pixelFormat;    // AVPixelFormat
+    int64_t pts;        // In the video stream's time base
+    double timestamp;   // Seconds, -1 when unknown
+} MediaFrame;
+
+// Return non-zero to stop decoding. Plane pointers are only valid during the call.
+typedef int (*FrameCallback)(const MediaFrame* frame, void* user);
+
+// Pixel and sample format fields take an FFmpeg format or this, to keep the decoder's format. 0 is
+// a real format in both (yuv420p, u8), so a zeroed options struct converts; start from the
+// init*Options functions instead, which set everything to the defaults.
+enum {
+    MEDIA_FORMAT_KEEP = -1
+};
+
+typedef struct DecodeOptions {
+    int width;          // 0 keeps the source size (or the aspect ratio when only height is set)
+    int height;
+    int pixelFormat;    // AVPixelFormat, or MEDIA_FORMAT_KEEP
+    double startTime;   // Seconds; decoding starts at the keyframe before it
+    int maxFrames;      // 0 decodes to the end
+    int keyframesOnly;
+} DecodeOptions;
+
+typedef struct MediaAudioChunk {
+    uint8_t* const* data;   // One plane per channel for planar formats, otherwise just data[0]
+    int numSamples;         // Per channel
+    int channels;
+    int sampleRate;
+    int sampleFormat;       // AVSampleFormat
+    double timestamp;       // Seconds from the start of the stream to the first sample
+} MediaAudioChunk;
+
+// Return non-zero to stop decoding. The sample buffers are reused and only valid during the call.
+typedef int (*AudioCallback)(const MediaAudioChunk* chunk, void* user);
+
+enum MediaStreamType {
+    MEDIA_STREAM_VIDEO = 1 << 0,
+    MEDIA_STREAM_AUDIO = 1 << 1,
+    MEDIA_STREAM_SUBTITLE = 1 << 2,
+    MEDIA_STREAM_DATA = 1 << 3,
+    MEDIA_STREAM_ATTACHMENT = 1 << 4
+};
+
+// Cancels the calls it's passed to from any thread; they stop at their next check and fail
+typedef struct MediaCancelToken MediaCancelToken;
+
+// Called on the calling thread with the fraction done (0..1), at most a few times a second
+typedef void (*MediaProgressCallback)(double fraction, void* user);
+
+typedef struct MediaCallControl {
+    MediaCancelToken* cancelToken;  // NULL: can't be cancelled
+    double timeoutSeconds;          // Fail once the call has run this long; 0: no deadline
+    MediaProgressCallback progress; // NULL: no progress reports
+    void* user;
+} MediaCallControl;
+
+typedef struct AudioDecodeOptions {
+    int sampleRate;         // 0 keeps the source rate
+    int sampleFormat;       // AVSampleFormat, packed or planar, or MEDIA_FORMAT_KEEP
+    int channels;           // 0 keeps the source layout; otherwise mixed to the default layout for the count
+    int chunkSamples;       // Samples per callback; 0 delivers whatever each decoded frame yields
+    const MediaCallControl* control; // Cancellation, deadline and progress; NULL for none
+} AudioDecodeOptions;
+
+typedef struct RemuxOptions {
+    int streamTypes;                // MEDIA_STREAM_* mask; 0 copies video, audio and subtitles the container supports
+    const int* streamIndices;       // Input stream indices to copy instead of streamTypes
+    int numStreamIndices;
+    int readBufferSize;             // Bytes; 0 uses 1 MiB
+    int writeBufferSize;            // Bytes; 0 uses 1 MiB
+    int disableBitstreamFilters;    // Don't insert h264/hevc_mp4toannexb or aac_adtstoasc for the output container
+    int fastStart;                  // MP4/MOV: put moov before mdat, in place when the reserved space suffices
+    const MediaCallControl* control; // Cancellation, deadline and progress; NULL for none
+} RemuxOptions;
+
+enum MediaJobState {
+    MEDIA_JOB_QUEUED,
+    MEDIA_JOB_RUNNING,
+    MEDIA_JOB_SUCCEEDED,
+    MEDIA_JOB_FAILED,
+    MEDIA_JOB_CANCELLED
+};
+
+enum MediaSegmentFormat {
+    MEDIA_SEGMENT_HLS_TS,       // <name>.m3u8 + <name>_NNNNN.ts
+    MEDIA_SEGMENT_HLS_FMP4,     // <name>.m3u8 + <name>_init.mp4 + <name>_NNNNN.m4s
+    MEDIA_SEGMENT_DASH          // <name>.mpd + <name>_init_<rep>.m4s + <name>_chunk_<rep>_NNNNN.m4s
+};
+
+typedef struct TranscodeOptions {
+    const char* videoEncoder;   // Encoder name, e.g. "libvpx-vp9" or "mpeg4"; null picks one the container accepts
+    const char* audioEncoder;   // e.g. "libopus" or "aac"; null picks one the container accepts
+    long long videoBitRate;     // Bits per second; 0 derives one from the source
+    long long audioBitRate;     // Bits per second; 0 uses 128 kb/s
+    int width;                  // 0 keeps the source size (or the aspect ratio when only height is set)
+    int height;
+    int encoderThreads;         // Threads per encoder; 0 lets libavcodec pick
+    int queueDepth;             // Frames buffered between decode, scale and encode; 0 uses 8
+    int copyCompatibleStreams;  // Stream-copy audio/video the container already supports
+    const MediaCallControl* control; // Cancellation, deadline and progress; NULL for none
+} TranscodeOptions;
+
+typedef struct RemuxProgress {
+    int state;                  // MediaJobState
+    long long bytesRead;
+    long long bytesWritten;
+    double processedSeconds;    // How far into the input the remux has got
+    double durationSeconds;     // Input duration, 0 when unknown
+    double bytesPerSecond;      // Average read throughput since the job started
+} RemuxProgress;
+
+// Output sink for the streaming remux variants. write returns the bytes written (all of them) or a
+// negative error. seek follows lseek() semantics, and whence 0x10000 asks for the total size (< 0
+// if unknown); pass NULL for pipes and sockets, which makes MP4/MOV output fragmented.
+typedef int (*MediaWriteCallback)(void* user, const uint8_t* buf, int size);
+typedef long long (*MediaSeekCallback)(void* user, long long offset, int whence);
+
+typedef struct LoudnessResult {
+    double integratedLoudness;  // LUFS (EBU R128 gated); -inf when everything is gated out
+    double loudnessRange;       // LU (EBU Tech 3342)
+    double truePeak;            // dBTP, 4x oversampled below 96 kHz
+    double samplePeak;          // dBFS
+} LoudnessResult;
+
+typedef struct SilenceSegment {
+    double start;               // Seconds
+    double end;
+} SilenceSegment;
+
+typedef struct MediaLibraryConfig {
+    int numThreads;             // Workers in the shared scheduler; 0 uses one per core
+    const int* cpuAffinity;     // CPU to pin each worker to (worker i gets entry i % numCpuAffinity), NULL to not pin (Linux only)
+    int numCpuAffinity;
+} MediaLibraryConfig;
+
+// Where a call's time went. Time in no phase (frame and audio callbacks, analysis) only shows in the totals.
+enum MediaPhase {
+    MEDIA_PHASE_NONE = -1,
+    MEDIA_PHASE_OPEN,           // Opening the input and detecting its format
+    MEDIA_PHASE_PROBE,          // avformat_find_stream_info
+    MEDIA_PHASE_CODEC_OPEN,     // Finding and opening decoders and encoders
+    MEDIA_PHASE_DECODE,         // Reading packets and decoding them
+    MEDIA_PHASE_SCALE,          // Pixel format conversion, scaling and resampling
+    MEDIA_PHASE_ENCODE,
+    MEDIA_PHASE_WRITE,          // Writing output files and muxing
+    MEDIA_PHASE_COPY,           // Packets read without decoding: stream copy, packet scans
+    MEDIA_PHASE_COUNT
+};
+
+typedef struct MediaPhaseTime {
+    double wallSeconds;
+    double cpuSeconds;          // CPU time of the library's threads; codec-internal threads aren't counted
+} MediaPhaseTime;
+
+typedef struct MediaCallStats {
+    MediaPhaseTime phases[MEDIA_PHASE_COUNT];
+    double wallSeconds;         // The whole call
+    double cpuSeconds;          // The whole call, including transcode pipeline threads
+    long long bytesRead;
+    long long framesDecoded;    // Video frames and audio frames
+} MediaCallStats;
+
+// Handle for an asynchronous call; release it with releaseMediaRequest, even after completion
+typedef struct MediaRequest MediaRequest;
+
+// Called once from the worker thread when the request finishes; the request may be released from here
+typedef void (*MediaRequestCallback)(MediaRequest* request, void* user);
+
+// Called from the job's worker thread a few times a second while it runs, and once when it finishes
+typedef void (*RemuxJobCallback)(long long jobId, const RemuxProgress* progress, void* user);
+
+int mediaLibraryInit(const MediaLibraryConfig* config);
+MediaCancelToken* createCancelToken(void);
+void cancelMediaCalls(MediaCancelToken* token);
+void releaseCancelToken(MediaCancelToken* token);
 double getMediaDuration(const char* filePath);
+double getMediaDurationExact(const char* filePath);
 int isValidMediaFile(const char* filePath);
 int convertMediaFormat(const char* srcFilePath, const char* destDirPath, const char* outputFileName, const char* outputFormat);
+int convertMediaFormatWithOptions(const char* srcFilePath, const char* destDirPath, const char* outputFileName, const char* outputFormat, const RemuxOptions* options);
+int convertMediaFormatToCallback(const char* srcFilePath, const char* outputFormat, const RemuxOptions* options, MediaWriteCallback write, MediaSeekCallback seek, void* user);
+int convertMediaFormatToFd(const char* srcFilePath, int fd, const char* outputFormat, const RemuxOptions* options);
+int trimMedia(const char* srcFilePath, const char* destDirPath, const char* outputFileName, const char* outputFormat, double startTime, double endTime, const RemuxOptions* options);
+int segmentMedia(const char* srcFilePath, const char* destDirPath, const char* outputFileName, int segmentFormat, double segmentDuration, const RemuxOptions* options);
+int extractAudio(const char* srcFilePath, const char* destDirPath, const char* outputFileName, const char* outputFormat);
+int concatMedia(const char** srcFilePaths, int numInputs, const char* destDirPath, const char* outputFileName, const char* outputFormat);
+int transcodeMedia(const char* srcFilePath, const char* destDirPath, const char* outputFileName, const char* outputFormat, const TranscodeOptions* options);
+// Returns the job id, or -1 when a path or the format is missing
+long long submitRemuxJob(const char* srcFilePath, const char* destDirPath, const char* outputFileName, const char* outputFormat, const RemuxOptions* options, RemuxJobCallback callback, void* user);
+int getRemuxJobProgress(long long jobId, RemuxProgress* progress);
+int waitRemuxJob(long long jobId);
+int cancelRemuxJob(long long jobId);
+void releaseRemuxJob(long long jobId);
+void setRemuxJobConcurrency(int numThreads);
 int generateThumbnail(const char* srcFilePath, const char* outputDirPath, const char* outputFileName, const char* outputFormat, int width, int height);
+int extractCoverArt(const char* srcFilePath, const char* outputDirPath, const char* outputFileName, int width, int height);
+int getCoverArt(const char* srcFilePath, uint8_t** data, int* size);
+void releaseCoverArt(uint8_t* data);
 char** generateThumbnails(const char* srcFilePath, const char* outputDirPath, int width, int height, int numThumbnails);
+char** generateThumbnailsWithControl(const char* srcFilePath, const char* outputDirPath, int width, int height, int numThumbnails, const MediaCallControl* control);
+void releaseThumbnails(char** thumbnails);
+int generateAnimatedPreview(const char* srcFilePath, const char* outputDirPath, const char* outputFileName, const char* outputFormat, int width, int height, int numFrames, int frameDelayMs);
+// Defaults: source size and format from the start, every frame
+void initDecodeOptions(DecodeOptions* options);
+int decodeFrames(const char* srcFilePath, FrameCallback callback, void* user, const DecodeOptions* options);
+// Writes a keyframe index next to the source as <file>.mlki; later seeks and frame lookups use it
+// while the source is unchanged
+int buildKeyframeIndex(const char* srcFilePath);
+// Unless the frame rate is constant, the first call for a file builds its .mlki index (see
+// buildKeyframeIndex); when that can't be written the keyframes are scanned in memory instead
+int generateThumbnailAtFrame(const char* srcFilePath, long long frameNumber, const char* outputDirPath, const char* outputFileName, const char* outputFormat, int width, int height);
+// Writes min/max peaks of the downmixed audio at samplesPerPixel and successively halved zoom
+// levels; JSON when outputPath ends in .json, otherwise a compact binary file (see library.cpp)
+int generateWaveform(const char* srcFilePath, int samplesPerPixel, const char* outputPath);
+int measureLoudness(const char* srcFilePath, LoudnessResult* result);
+int generateSpectrogram(const char* srcFilePath, int width, int height, const char* outputPath);
+// Defaults: source rate, format and layout, each decoded frame as it comes
+void initAudioDecodeOptions(AudioDecodeOptions* options);
+// Returns the samples per channel delivered, also when the callback stopped early; -1 when the file
+// can't be decoded, decoding fails, or the call is cancelled or runs past its deadline
+long long decodeAudio(const char* srcFilePath, AudioCallback callback, void* user, const AudioDecodeOptions* options);
+int detectSilence(const char* srcFilePath, double thresholdDb, double minDuration, SilenceSegment** segments);
+void releaseSilenceSegments(SilenceSegment* segments);
+// Call statistics are off by default: recording reads the thread CPU clock at every phase change.
+// The setting applies to calls that start after it.
+void setCallStatsEnabled(int enabled);
+// Stats of the last library call that finished on the calling thread; 0 if there is none or it
+// ran with statistics off
+int getLastCallStats(MediaCallStats* stats);
+// Caps the bytes of image buffers each thread keeps for reuse (64 MiB by default). 0 or less turns
+// the pools off: threads free what they hold on their next call and allocate fresh buffers after.
+// releaseFramePools frees the calling thread's pools right away.
+void setFramePoolLimit(long long maxRetainedBytes);
+void releaseFramePools(void);
+
+// Asynchronous variants: they return at once and run on the library's scheduler. The result is
+// what the blocking call returns; an fd from getMediaRequestFd becomes readable on completion
+// (an eventfd on Linux, a pipe elsewhere) and is closed with the request. They return null, with
+// nothing started, when a path or format argument is null.
+MediaRequest* generateThumbnailAsync(const char* srcFilePath, const char* outputDirPath, const char* outputFileName, const char* outputFormat, int width, int height, MediaRequestCallback callback, void* user);
+MediaRequest* convertMediaFormatAsync(const char* srcFilePath, const char* destDirPath, const char* outputFileName, const char* outputFormat, const RemuxOptions* options, MediaRequestCallback callback, void* user);
+MediaRequest* getMediaDurationAsync(const char* filePath, MediaRequestCallback callback, void* user);
+MediaRequest* getMediaDurationExactAsync(const char* filePath, MediaRequestCallback callback, void* user);
+MediaRequest* isValidMediaFileAsync(const char* filePath, MediaRequestCallback callback, void* user);
+int isMediaRequestDone(MediaRequest* request);
+double waitMediaRequest(MediaRequest* request);
+double getMediaRequestResult(MediaRequest* request);
+void cancelMediaRequest(MediaRequest* request);
+int getMediaRequestFd(MediaRequest* request);
+int getMediaRequestStats(MediaRequest* request, MediaCallStats* stats);
+void releaseMediaRequest(MediaRequest* request);
 
 #ifdef __cplusplus
 }